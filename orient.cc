@@ -3,18 +3,53 @@
 #include <string>
 #include <cmath>
 #include <cstdlib>
+#include <cstdio>
 #include <vector>
 #include <algorithm>
 #include <exception>
 #include <fstream>
-
-using namespace std;
-using namespace cv;
+#include <sstream>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cctype>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <climits>
+#include <ctime>
+#include <chrono>
+#include <csetjmp>
+#include <functional>
+#include <map>
+#include <zlib.h>
+#ifdef ORIENT_HAVE_TIFF
+#include <tiffio.h>
+#endif
+#ifdef ORIENT_HAVE_JPEG
+extern "C" {
+#include <jpeglib.h>
+}
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "orient_core.h"
+#include "orient_io.h"
+#include "orient_pack.h"
+#include "orient_spool.h"
+#include "orient_bands.h"
+#include "orient_solver.h"
 
 const double PI = 3.14159265358979323846;
 
-Vec3b hsv2rgb (float h, float s, float v);
-
 class Pixel {
 public:
     Vec2i position;
@@ -52,21 +87,192 @@ float GaussianFilter::operator() (float x)
     return exp(-0.5 * pow((x-miu)/sigma, 2)) / (sigma * sqrt(2*PI));
 }
 
-void bilateralFilter (const Vec2i& centerPosition, vector<Pixel>& neighbors, const Mat& coloredImage)
+FilterParams::FilterParams (int kernelSize_, float spatialSigma_, float colorSigma_)
+    : kernelSize(kernelSize_)
+    , spatialSigma(spatialSigma_)
+    , colorSigma(colorSigma_) {}
+
+const FilterParams defaultFilterParams(5, 2.0f, 10.0f);
+
+int maxThreads ()
+{
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+// threads for the OpenMP loops and for OpenCV's own pool
+void setThreads (int threads)
 {
-    static GaussianFilter spatialFilter(2.0f, 0.0f);
-    static GaussianFilter colorFilter(10.0f, 0.0f);
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#endif
+    setNumThreads(threads);
+}
+
+TeamSize::TeamSize (int threads)
+    : saved(maxThreads())
+{
+#ifdef _OPENMP
+    if (threads > 0) {
+        omp_set_num_threads(threads);
+    }
+#endif
+}
 
-    const Vec3b& centerColor = coloredImage.at<Vec3b>(centerPosition[0], centerPosition[1]);
+TeamSize::~TeamSize ()
+{
+#ifdef _OPENMP
+    omp_set_num_threads(saved);
+#endif
+}
 
-    for (size_t i = 0; i < neighbors.size(); ++i) {
-        const Pixel& neighbor = neighbors[i];
-        const Vec3b& neighborColor = coloredImage.at<Vec3b>(neighbor.position[0], neighbor.position[1]);
+Tiling::Tiling (int rows_, int cols_)
+    : rows(rows_)
+    , cols(cols_) {}
+
+const Tiling defaultTiling(1, 0);
+
+CancelToken::CancelToken ()
+    : cancelFlag(false)
+    , deadline(0) {}
+
+int64_t CancelToken::now ()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void CancelToken::cancel ()
+{
+    cancelFlag = true;
+}
+
+void CancelToken::reset ()
+{
+    cancelFlag = false;
+    deadline = 0;
+}
+
+void CancelToken::setBudget (double seconds)
+{
+    deadline = max<int64_t>(1, now() + int64_t(seconds * 1e9));
+}
+
+bool CancelToken::cancelled () const
+{
+    return cancelFlag;
+}
+
+bool CancelToken::stopped () const
+{
+    const int64_t end = deadline;
+    return cancelFlag || (end != 0 && now() >= end);
+}
+
+bool CancelToken::fits (double seconds) const
+{
+    const int64_t end = deadline;
+    return !cancelFlag && (end == 0 || now() + int64_t(seconds * 1e9) < end);
+}
+
+CancelRun::CancelRun (CancelToken& token_, double budgetSeconds)
+    : token(token_)
+{
+    if (budgetSeconds > 0) {
+        token.setBudget(budgetSeconds);
+    }
+}
+
+CancelRun::~CancelRun ()
+{
+    token.reset();
+}
+
+// what SIGUSR1 cancels: a run of runImage, or the frame runStream is on (the
+// next one if it comes between frames)
+CancelToken signalCancelToken;
+
+void cancelOnSignal (int)
+{
+    signalCancelToken.cancel();
+}
+
+// colorSigma is given in 8-bit levels; this converts it to the image's own
+// units (16-bit spans 257 times the range, float images are taken as [0, 1])
+float colorScale (int depth)
+{
+    if (depth == CV_16U) {
+        return 257.0f;
+    } else if (depth == CV_32F) {
+        return 1.0f / 255.0f;
+    }
+    return 1.0f;
+}
+
+BilateralWeights::BilateralWeights (const FilterParams& params, int type)
+    : radius(params.kernelSize / 2)
+    , depth(CV_MAT_DEPTH(type))
+    , channels(CV_MAT_CN(type))
+    , colorSigma(params.colorSigma * colorScale(CV_MAT_DEPTH(type)))
+    , colorNorm(1.0f / (params.colorSigma * sqrt(2*PI)))
+{
+    GaussianFilter spatialFilter(params.spatialSigma, 0.0f);
+    const int k = 2*radius + 1;
+    spatialTable.resize(k * k);
+    for (int dr = -radius; dr <= radius; ++dr) {
+        for (int dc = -radius; dc <= radius; ++dc) {
+            spatialTable[(dr+radius) * k + dc+radius] = spatialFilter(sqrt(float(dr*dr + dc*dc)));
+        }
+    }
+    if (depth == CV_8U || depth == CV_16U) {
+        channelTable.resize(depth == CV_8U ? 256 : 65536);
+        for (size_t d = 0; d < channelTable.size(); ++d) {
+            channelTable[d] = exp(-0.5 * pow(d / colorSigma, 2));
+        }
+    }
+}
+
+float BilateralWeights::spatial (int dr, int dc) const
+{
+    return spatialTable[(dr+radius) * (2*radius+1) + dc+radius];
+}
 
-        float spatialDistance = norm(centerPosition - neighbor.position);
-        float colorDistance = norm(centerColor - neighborColor);
+float BilateralWeights::color (const Mat& coloredImage, const Vec2i& p, const Vec2i& q) const
+{
+    float weight = colorNorm;
+    if (depth == CV_8U) {
+        const uchar* a = coloredImage.ptr<uchar>(p[0]) + p[1] * channels;
+        const uchar* b = coloredImage.ptr<uchar>(q[0]) + q[1] * channels;
+        for (int ch = 0; ch < channels; ++ch) {
+            weight *= channelTable[abs(a[ch] - b[ch])];
+        }
+        return weight;
+    } else if (depth == CV_16U) {
+        const ushort* a = coloredImage.ptr<ushort>(p[0]) + p[1] * channels;
+        const ushort* b = coloredImage.ptr<ushort>(q[0]) + q[1] * channels;
+        for (int ch = 0; ch < channels; ++ch) {
+            weight *= channelTable[abs(a[ch] - b[ch])];
+        }
+        return weight;
+    }
+    const float* a = coloredImage.ptr<float>(p[0]) + p[1] * channels;
+    const float* b = coloredImage.ptr<float>(q[0]) + q[1] * channels;
+    float squared = 0.0f;
+    for (int ch = 0; ch < channels; ++ch) {
+        squared += (a[ch] - b[ch]) * (a[ch] - b[ch]);
+    }
+    return exp(-0.5f * squared / (colorSigma * colorSigma)) * weight;
+}
 
-        neighbors[i].weight = spatialFilter(spatialDistance) * colorFilter(colorDistance);
+void bilateralFilter (const Vec2i& centerPosition, vector<Pixel>& neighbors,
+                      const Mat& coloredImage, const BilateralWeights& weights)
+{
+    for (size_t i = 0; i < neighbors.size(); ++i) {
+        const Vec2i& position = neighbors[i].position;
+        neighbors[i].weight = weights.spatial(position[0] - centerPosition[0], position[1] - centerPosition[1])
+                            * weights.color(coloredImage, centerPosition, position);
     }
 }
 
@@ -87,8 +293,8 @@ float interpolateAngle (vector<Pixel>& neighbors)
 {
     sort(neighbors.begin(), neighbors.end(), comparePixelByAngle);
     float minDiff = neighbors.back().angle - neighbors[0].angle;
-    int minIndex = 0;
-    for (int i = 1; i < neighbors.size(); ++i) {
+    size_t minIndex = 0;
+    for (size_t i = 1; i < neighbors.size(); ++i) {
         float diff = neighbors[i-1].angle + PI - neighbors[i].angle;
         if (diff < minDiff) {
             minDiff = diff;
@@ -98,7 +304,7 @@ float interpolateAngle (vector<Pixel>& neighbors)
 
     float avgAngle = 0.0f;
     float sumMagWeights = 0.0f;
-    for (int i = 0; i < neighbors.size(); ++i) {
+    for (size_t i = 0; i < neighbors.size(); ++i) {
         float magWeight = neighbors[i].weight * neighbors[i].magnitude;
         if (i < minIndex) {
             avgAngle += (neighbors[i].angle + PI) * magWeight;
@@ -116,7 +322,7 @@ float interpolateAngle (vector<Pixel>& neighbors)
 
 void printPixels (const vector<Pixel>& qualifiedNeighbors)
 {
-    for (int i = 0; i < qualifiedNeighbors.size(); ++i) {
+    for (size_t i = 0; i < qualifiedNeighbors.size(); ++i) {
         cout << "r: " << qualifiedNeighbors[i].position[0]
              << ", c: " << qualifiedNeighbors[i].position[1]
              << ", angle: " << qualifiedNeighbors[i].angle
@@ -124,10 +330,11 @@ void printPixels (const vector<Pixel>& qualifiedNeighbors)
     }
 }
 
-// k is kernelSize;
-void updateCell (int r, int c, int k, Mat& nextAngles, Mat& nextMagnitudes,
+void updateCell (int r, int c, const FilterParams& params, const BilateralWeights& weights,
+                 Mat& nextAngles, Mat& nextMagnitudes,
                  const Mat& angles, const Mat& magnitudes, const Mat& coloredImage)
 {
+    const int k = params.kernelSize;
     const int rows = angles.rows;
     const int cols = angles.cols;
     const int leftMost = max(0, c-k/2);
@@ -135,7 +342,9 @@ void updateCell (int r, int c, int k, Mat& nextAngles, Mat& nextMagnitudes,
     const int upMost = max(0, r-k/2);
     const int downMost = min(rows-1, r+k/2);
 
-    vector<Pixel> qualifiedNeighbors;
+    // one per thread, reused for every cell instead of a heap allocation each
+    static thread_local vector<Pixel> qualifiedNeighbors;
+    qualifiedNeighbors.clear();
 
     for (int rr = upMost; rr <= downMost; ++rr) {
         for (int cc = leftMost; cc <= rightMost; ++cc) {
@@ -146,196 +355,3282 @@ void updateCell (int r, int c, int k, Mat& nextAngles, Mat& nextMagnitudes,
     }
 
     assert(qualifiedNeighbors.size() >= 1);
+    // only the center qualifies: it keeps its value. nextAngles may hold a
+    // stale or (in a strip window) recycled row, so it is written anyway
     if (qualifiedNeighbors.size() == 1) {
+        nextAngles.at<float>(r,c) = angles.at<float>(r,c);
+        nextMagnitudes.at<float>(r,c) = magnitudes.at<float>(r,c);
         return;
     }
-    bilateralFilter(Vec2i(r,c), qualifiedNeighbors, coloredImage);
+    bilateralFilter(Vec2i(r,c), qualifiedNeighbors, coloredImage, weights);
     nextMagnitudes.at<float>(r,c) = interpolateMagnitude(qualifiedNeighbors);
     // next statement will sort the qualifiedNeighbors according to angles
     nextAngles.at<float>(r,c) = interpolateAngle(qualifiedNeighbors);
 }
 
-void iterate (int k, Mat& angles, Mat& magnitudes, Mat& nextAngles, Mat& nextMagnitudes, const Mat& coloredImage)
+// weights are for params and coloredImage's type; callers iterating the
+// same image many times (the library) build them once. returns false, with
+// angles and magnitudes untouched, if cancel stopped the iteration.
+bool iterate (const FilterParams& params, const BilateralWeights& weights, Mat& angles, Mat& magnitudes,
+              Mat& nextAngles, Mat& nextMagnitudes, const Mat& coloredImage,
+              const Tiling& tiling, const CancelToken* cancel)
 {
     const int rows = angles.rows;
     const int cols = angles.cols;
-    // #pragma omp parallel for
-    for (int r = 0; r < rows; ++r) {
-        for (int c = 0; c < cols; ++c) {
-            updateCell(r, c, k, nextAngles, nextMagnitudes, angles, magnitudes, coloredImage);
+    const int tileCols = tiling.cols > 0 ? tiling.cols : cols;
+    const int tilesAcross = (cols + tileCols - 1) / tileCols;
+    const int tilesDown = (rows + tiling.rows - 1) / tiling.rows;
+    // the remaining tiles are skipped, not interrupted: an openmp loop
+    // cannot be left early
+    atomic<bool> abandoned(false);
+    #pragma omp parallel for schedule(dynamic)
+    for (int t = 0; t < tilesDown * tilesAcross; ++t) {
+        if (cancel && (abandoned || cancel->stopped())) {
+            abandoned = true;
+            continue;
+        }
+        const int r0 = t / tilesAcross * tiling.rows;
+        const int c0 = t % tilesAcross * tileCols;
+        for (int r = r0; r < min(rows, r0 + tiling.rows); ++r) {
+            for (int c = c0; c < min(cols, c0 + tileCols); ++c) {
+                updateCell(r, c, params, weights, nextAngles, nextMagnitudes, angles, magnitudes, coloredImage);
+            }
         }
     }
+    if (abandoned) {
+        return false;
+    }
 
     swap(angles, nextAngles);
     swap(magnitudes, nextMagnitudes);
+    return true;
 }
 
-void calcGradients (const string& imageName, Mat& angles, Mat& magnitudes)
+bool iterate (const FilterParams& params, Mat& angles, Mat& magnitudes,
+              Mat& nextAngles, Mat& nextMagnitudes, const Mat& coloredImage,
+              const Tiling& tiling, const CancelToken* cancel)
 {
-    const int ddepth = CV_32F;
+    return iterate(params, BilateralWeights(params, coloredImage.type()), angles, magnitudes, nextAngles,
+                   nextMagnitudes, coloredImage, tiling, cancel);
+}
 
-    Mat src = imread(imageName, CV_LOAD_IMAGE_GRAYSCALE);
-    Mat gradX, gradY;
-    // Sobel(src, gradX, ddepth, 1, 0, 5);
-    // Sobel(src, gradY, ddepth, 0, 1, 5);
-    Scharr(src, gradX, ddepth, 1, 0);
-    Scharr(src, gradY, ddepth, 0, 1);
+// approximate bilateral engine: a bilateral grid over (x, y, luma) with one
+// cell per spatialSigma pixels and per colorSigma grey levels. the magnitude
+// weighted doubled-angle vectors are splatted into the grid, blurred with a
+// [1 2 1] kernel along each axis and sliced back trilinearly, so the cost per
+// iteration is independent of the kernel size. unlike updateCell it averages
+// all neighbors, not only those at least as strong as the center.
+class BilateralGrid {
+public:
+    BilateralGrid (const Mat& coloredImage, const FilterParams& params, bool rgbOrder=false);
+    void filter (const Mat& angles, const Mat& magnitudes, Mat& nextAngles, Mat& nextMagnitudes);
+private:
+    float spatialStep;
+    float rangeStep;
+    float minLuma;
+    int gridRows;
+    int gridCols;
+    int gridDepth;
+    Mat luma;
+    vector<Vec4f> cells;
+    vector<Vec4f> scratch;
+    void blur (int stride, int length);
+};
 
-    divide(gradX, -gradY, angles);
-    // #pragma omp parallel for
-    for (int r = 0; r < angles.rows; ++r) {
-        for (int c = 0; c < angles.cols; ++c) {
-            angles.at<float>(r,c) = atan(angles.at<float>(r,c));
-        }
+BilateralGrid::BilateralGrid (const Mat& coloredImage, const FilterParams& params, bool rgbOrder)
+    : spatialStep(max(1.0f, params.spatialSigma))
+    , rangeStep(max(1.0f, params.colorSigma) * colorScale(coloredImage.depth()))
+{
+    Mat grey = coloredImage;
+    if (coloredImage.channels() == 3) {
+        cvtColor(coloredImage, grey, rgbOrder ? CV_RGB2GRAY : CV_BGR2GRAY);
     }
+    grey.convertTo(luma, CV_32F);
+    double lo, hi;
+    minMaxLoc(luma, &lo, &hi);
+    minLuma = lo;
+    // one padding cell on each side keeps the blur and the slice in bounds.
+    // splatting rounds, so the last pixel lands in cell int(x + 0.5) + 1,
+    // which has to be an inner one
+    gridRows = int((luma.rows - 1) / spatialStep + 0.5f) + 3;
+    gridCols = int((luma.cols - 1) / spatialStep + 0.5f) + 3;
+    gridDepth = int((float(hi) - minLuma) / rangeStep + 0.5f) + 3;
+    cells.resize(size_t(gridRows) * gridCols * gridDepth);
+    scratch.resize(cells.size());
+}
 
-    magnitude(gradX, gradY, magnitudes);
+void BilateralGrid::blur (int stride, int length)
+{
+    const int total = cells.size();
+    #pragma omp parallel for
+    for (int i = 0; i < total; ++i) {
+        int pos = (i / stride) % length;
+        if (pos == 0 || pos == length - 1) {
+            scratch[i] = cells[i];
+        } else {
+            scratch[i] = (cells[i-stride] + cells[i] * 2.0f + cells[i+stride]) * 0.25f;
+        }
+    }
+    cells.swap(scratch);
 }
 
-void saveAngleGraph (const string& imageName, const Mat& angles,
-                     const Mat& magnitudes, float threshold=0.0f)
+void BilateralGrid::filter (const Mat& angles, const Mat& magnitudes, Mat& nextAngles, Mat& nextMagnitudes)
 {
     const int rows = angles.rows;
     const int cols = angles.cols;
+    const int planeSize = gridCols * gridDepth;
+    fill(cells.begin(), cells.end(), Vec4f(0, 0, 0, 0));
 
-    Mat imageOfAngles = Mat(rows, cols, CV_8UC3);
-    double maxMagnitude;
-    minMaxLoc(magnitudes, 0, &maxMagnitude);
-    float t = maxMagnitude * threshold;
+    // splat: every image row lands in exactly one grid row, so threads that
+    // own different grid rows never write the same cell
+    #pragma omp parallel for
+    for (int gr = 1; gr < gridRows - 1; ++gr) {
+        const int firstRow = max(0, int((gr - 1.5f) * spatialStep) - 1);
+        const int lastRow = min(rows, int((gr - 0.5f) * spatialStep) + 2);
+        for (int r = firstRow; r < lastRow; ++r) {
+            if (int(r / spatialStep + 0.5f) + 1 != gr) {
+                continue;
+            }
+            for (int c = 0; c < cols; ++c) {
+                int gc = int(c / spatialStep + 0.5f) + 1;
+                int gz = int((luma.at<float>(r,c) - minLuma) / rangeStep + 0.5f) + 1;
+                float m = magnitudes.at<float>(r,c);
+                float a = 2 * angles.at<float>(r,c);
+                cells[gr * planeSize + gc * gridDepth + gz] += Vec4f(m * cos(a), m * sin(a), m, 1.0f);
+            }
+        }
+    }
 
-    // #pragma omp parallel for
+    blur(1, gridDepth);
+    blur(gridDepth, gridCols);
+    blur(planeSize, gridRows);
+
+    // slice
+    #pragma omp parallel for
     for (int r = 0; r < rows; ++r) {
+        float y = r / spatialStep + 1;
+        int y0 = int(y);
+        float fy = y - y0;
         for (int c = 0; c < cols; ++c) {
-            if (magnitudes.at<float>(r,c) > t) {
-                try {
-                    imageOfAngles.at<Vec3b>(r,c) = hsv2rgb(angles.at<float>(r,c), 1.0, 1.0);
-                } catch (double a) {
-                    cout << r << ", " << c << "; Invalid angle: " << a << endl;
-                    assert(false);
+            float x = c / spatialStep + 1;
+            float z = (luma.at<float>(r,c) - minLuma) / rangeStep + 1;
+            int x0 = int(x);
+            int z0 = int(z);
+            float fx = x - x0;
+            float fz = z - z0;
+            Vec4f v(0, 0, 0, 0);
+            for (int dy = 0; dy < 2; ++dy) {
+                for (int dx = 0; dx < 2; ++dx) {
+                    for (int dz = 0; dz < 2; ++dz) {
+                        float w = (dy ? fy : 1 - fy) * (dx ? fx : 1 - fx) * (dz ? fz : 1 - fz);
+                        v += cells[(y0+dy) * planeSize + (x0+dx) * gridDepth + z0 + dz] * w;
+                    }
                 }
-            } else {
-                imageOfAngles.at<Vec3b>(r,c) = Vec3b(0,0,0);
             }
+            if (v[3] <= 0.0f || v[2] <= 0.0f) {
+                nextAngles.at<float>(r,c) = angles.at<float>(r,c);
+                nextMagnitudes.at<float>(r,c) = magnitudes.at<float>(r,c);
+                continue;
+            }
+            float angle = 0.5f * atan2(v[1], v[0]);
+            if (angle >= PI/2) {
+                angle -= PI;
+            }
+            nextAngles.at<float>(r,c) = angle;
+            nextMagnitudes.at<float>(r,c) = v[2] / v[3];
         }
     }
+}
 
-    cout << "saving " << imageName << endl;
-    cvtColor(imageOfAngles, imageOfAngles, CV_RGB2BGR);
-    imwrite(imageName, imageOfAngles);
+void iterateGrid (BilateralGrid& grid, Mat& angles, Mat& magnitudes, Mat& nextAngles, Mat& nextMagnitudes)
+{
+    grid.filter(angles, magnitudes, nextAngles, nextMagnitudes);
+    swap(angles, nextAngles);
+    swap(magnitudes, nextMagnitudes);
 }
 
-void saveAngleGreyGraph (const string& imageName, const Mat& angles)
+// separable derivative filter: gradX applies deriv along the row and smooth
+// down the column, gradY the other way round. both have 2*radius+1 taps.
+class GradientKernel {
+public:
+    vector<float> deriv;
+    vector<float> smooth;
+    int radius;
+    GradientKernel (const vector<float>& deriv_, const vector<float>& smooth_);
+};
+
+GradientKernel::GradientKernel (const vector<float>& deriv_, const vector<float>& smooth_)
+    : deriv(deriv_)
+    , smooth(smooth_)
+    , radius(deriv_.size() / 2) {}
+
+const char* const gradientOperatorNames[] = {"scharr", "sobel3", "sobel5", "sobel7", "central", "tensor"};
+const int numGradientOperators = 6;
+
+// returns false if name is not one of gradientOperatorNames
+bool parseGradientOperator (const string& name, GradientOperator& op)
 {
-    const int rows = angles.rows;
-    const int cols = angles.cols;
-    Mat imageOfAngles = Mat(rows, cols, CV_8U);
+    for (int i = 0; i < numGradientOperators; ++i) {
+        if (name == gradientOperatorNames[i]) {
+            op = GradientOperator(i);
+            return true;
+        }
+    }
+    return false;
+}
 
-    for (int r = 0; r < rows; ++r) {
+// the kernels are built once; the structure tensor is built from scharr's
+const GradientKernel& gradientKernel (GradientOperator op)
+{
+    static const float scharrDeriv[] = {-1, 0, 1};
+    static const float scharrSmooth[] = {3, 10, 3};
+    static const float sobel3Smooth[] = {1, 2, 1};
+    static const float sobel5Deriv[] = {-1, -2, 0, 2, 1};
+    static const float sobel5Smooth[] = {1, 4, 6, 4, 1};
+    static const float sobel7Deriv[] = {-1, -4, -5, 0, 5, 4, 1};
+    static const float sobel7Smooth[] = {1, 6, 15, 20, 15, 6, 1};
+    static const float centralSmooth[] = {0, 1, 0};
+    static const GradientKernel kernels[] = {
+        GradientKernel(vector<float>(scharrDeriv, scharrDeriv+3), vector<float>(scharrSmooth, scharrSmooth+3)),
+        GradientKernel(vector<float>(scharrDeriv, scharrDeriv+3), vector<float>(sobel3Smooth, sobel3Smooth+3)),
+        GradientKernel(vector<float>(sobel5Deriv, sobel5Deriv+5), vector<float>(sobel5Smooth, sobel5Smooth+5)),
+        GradientKernel(vector<float>(sobel7Deriv, sobel7Deriv+7), vector<float>(sobel7Smooth, sobel7Smooth+7)),
+        GradientKernel(vector<float>(scharrDeriv, scharrDeriv+3), vector<float>(centralSmooth, centralSmooth+3))
+    };
+    return kernels[op == GRADIENT_TENSOR ? GRADIENT_SCHARR : op];
+}
+
+// the vectorizable inner loops of the gradient passes and the color map.
+// each body is inlined into one wrapper per instruction set below, so the
+// compiler vectorizes it for that set, and the wrapper for the running CPU is
+// picked at startup. the build turns off FP contraction (avx512 implies FMA),
+// so every set rounds each sum the same way and all of them give the same
+// bits, and FP trapping (nothing reads the exception flags), so the selects
+// below may evaluate both of their sides.
+
+// d and s get the deriv and smooth taps applied along one padded row g
+template <typename T>
+inline __attribute__((always_inline))
+void rowPassBody (const T* g, const T* deriv, const T* smooth, int taps, int cols, T* d, T* s)
+{
+    for (int c = 0; c < cols; ++c) {
+        d[c] = 0;
+        s[c] = 0;
+    }
+    for (int t = 0; t < taps; ++t) {
+        const T kd = deriv[t];
+        const T ks = smooth[t];
+        const T* gt = g + t;
         for (int c = 0; c < cols; ++c) {
-            float ratio = (angles.at<float>(r,c) + PI/2) / PI;
-            if (ratio > 1.0f) {
-                cout << "saveAngleGreyGraph: " << r << ", " << c << ", ratio: " << ratio << endl;
-                ratio = 1.0f;
-            } else if (ratio < 0.0f) {
-                cout << "saveAngleGreyGraph: " << r << ", " << c << ", ratio: " << ratio << endl;
-                ratio = 0.0f;
-            }
-            // unsigned char greyVal = ratio * 255;
-            imageOfAngles.at<unsigned char>(r,c) = (unsigned char) (ratio * 255);
+            d[c] += kd * gt[c];
+            s[c] += ks * gt[c];
         }
     }
-    imwrite(imageName, imageOfAngles);
 }
 
-void saveAngleToFile (const string& fileName, const Mat& angles)
+// gx and gy of one output row, from taps rows of dx and sx stride apart
+template <typename T>
+inline __attribute__((always_inline))
+void columnPassBody (const T* dx, const T* sx, size_t stride, const T* deriv, const T* smooth,
+                     int taps, int cols, T* gx, T* gy)
 {
-    const int rows = angles.rows;
-    const int cols = angles.cols;
-
-    ofstream out_file(fileName);
-    out_file << rows << " " << cols << endl;
-    for (int r = 0; r < rows; ++r) {
+    for (int c = 0; c < cols; ++c) {
+        gx[c] = 0;
+        gy[c] = 0;
+    }
+    for (int t = 0; t < taps; ++t) {
+        const T ks = smooth[t];
+        const T kd = deriv[t];
+        const T* d = dx + t * stride;
+        const T* s = sx + t * stride;
         for (int c = 0; c < cols; ++c) {
-            out_file << angles.at<float>(r,c) << " ";
+            gx[c] += ks * d[c];
+            gy[c] += kd * s[c];
         }
-        out_file << endl;
     }
-    out_file.close();
 }
 
-void saveMagnitudeGraph (const string& imageName, const Mat& magnitudes)
+inline __attribute__((always_inline))
+void magnitudeBody (const float* gx, const float* gy, int cols, float* magnitudes)
 {
-    const int rows = magnitudes.rows;
-    const int cols = magnitudes.cols;
+    for (int c = 0; c < cols; ++c) {
+        magnitudes[c] = sqrt(gx[c]*gx[c] + gy[c]*gy[c]);
+    }
+}
 
-    Mat imageOfMagnitudes = Mat(rows, cols, CV_8U);
-    double maxMagnitude;
-    minMaxLoc(magnitudes, 0, &maxMagnitude);
+inline __attribute__((always_inline))
+void squaredMagnitudeBody (const short* gx, const short* gy, int cols, int* squared)
+{
+    for (int c = 0; c < cols; ++c) {
+        squared[c] = int(gx[c]) * gx[c] + int(gy[c]) * gy[c];
+    }
+}
 
-    // #pragma omp parallel for
-    for (int r = 0; r < rows; ++r) {
+// atan(x/-y), with the y == 0 limit folded to -pi/2 (pi/2 and -pi/2 are the
+// same orientation, and [-pi/2, pi/2) is the range we keep). atan is cephes'
+// single precision one (within 2 ulp), written with selects instead of a libm
+// call so that rows vectorize.
+inline __attribute__((always_inline))
+float gradientAngle (float gx, float gy)
+{
+    const float x = gx / -gy;
+    const float ax = fabs(x);
+    // atan(ax) = base + atan(reduced), with reduced within tan(pi/8)
+    const bool high = ax > 2.414213562373095f;
+    const bool middle = !high && ax > 0.4142135623730950f;
+    const float reduced = high ? -1.0f / ax : middle ? (ax - 1.0f) / (ax + 1.0f) : ax;
+    const float base = high ? float(PI/2) : middle ? float(PI/4) : 0.0f;
+    const float z = reduced * reduced;
+    const float poly = ((8.05374449538e-2f * z - 1.38776856032e-1f) * z + 1.99777106478e-1f) * z
+                       - 3.33329491539e-1f;
+    const float angle = copysign(base + (poly * z * reduced + reduced), x);
+    return gy == 0.0f ? (gx == 0.0f ? 0.0f : float(-PI/2)) : angle;
+}
+
+template <typename T>
+inline __attribute__((always_inline))
+void angleBody (const T* gx, const T* gy, int cols, float* angles)
+{
+    for (int c = 0; c < cols; ++c) {
+        angles[c] = gradientAngle(gx[c], gy[c]);
+    }
+}
+
+// the one of v, q, t and p that a channel takes in sextant k of the hue
+// circle, picked by multiplying with 0 or 1 rather than by branching, so a
+// row of pixels vectorizes
+inline __attribute__((always_inline))
+float sextantComponent (int k, float v, float q, float t, float p)
+{
+    return ((k == 0) | (k == 5)) * v + (k == 1) * q + (k == 4) * t + ((k == 2) | (k == 3)) * p;
+}
+
+// h in rad; h outside [-pi/2, pi/2] gives black
+inline __attribute__((always_inline))
+void hsv2rgb (float h, float s, float v, float& red, float& green, float& blue)
+{
+    const float ah = (h + PI/2) / PI * 360;
+    const int hi = int(ah / 60);
+    const float f = ah / 60 - hi;
+    const float p = v * (1 - s);
+    const float q = v * (1 - f * s);
+    const float t = v * (1 - (1 - f) * s);
+    // h == pi/2 lands on 360, the end of the last sextant
+    const int k = ah == 360 ? 5 : hi;
+    const bool valid = k >= 0 && k <= 5;
+    // green runs two sextants behind red, and blue four
+    red = valid ? sextantComponent(k, v, q, t, p) : 0.0f;
+    green = valid ? sextantComponent(k >= 2 ? k - 2 : k + 4, v, q, t, p) : 0.0f;
+    blue = valid ? sextantComponent(k >= 4 ? k - 4 : k + 2, v, q, t, p) : 0.0f;
+}
+
+// one row of the orientation map, BGR, black where the magnitude is not
+// above t
+inline __attribute__((always_inline))
+void colorMapBody (const float* angles, const float* magnitudes, float t, int cols, uchar* bgr)
+{
+    for (int c = 0; c < cols; ++c) {
+        float red, green, blue;
+        hsv2rgb(angles[c], 1.0f, 1.0f, red, green, blue);
+        const bool shown = magnitudes[c] > t;
+        bgr[3*c] = shown ? uchar(blue * 255) : 0;
+        bgr[3*c+1] = shown ? uchar(green * 255) : 0;
+        bgr[3*c+2] = shown ? uchar(red * 255) : 0;
+    }
+}
+
+struct HotKernels {
+    const char* isa;
+    void (*rowPass) (const float* g, const float* deriv, const float* smooth, int taps, int cols,
+                     float* d, float* s);
+    void (*rowPassFixed) (const short* g, const short* deriv, const short* smooth, int taps, int cols,
+                          short* d, short* s);
+    void (*columnPass) (const float* dx, const float* sx, size_t stride, const float* deriv,
+                        const float* smooth, int taps, int cols, float* gx, float* gy);
+    void (*columnPassFixed) (const short* dx, const short* sx, size_t stride, const short* deriv,
+                             const short* smooth, int taps, int cols, short* gx, short* gy);
+    void (*magnitude) (const float* gx, const float* gy, int cols, float* magnitudes);
+    void (*squaredMagnitude) (const short* gx, const short* gy, int cols, int* squared);
+    void (*angle) (const float* gx, const float* gy, int cols, float* angles);
+    void (*angleFixed) (const short* gx, const short* gy, int cols, float* angles);
+    void (*colorMap) (const float* angles, const float* magnitudes, float t, int cols, uchar* bgr);
+};
+
+#define DEFINE_HOT_KERNELS(name, isa, attributes) \
+attributes void rowPass_##name (const float* g, const float* deriv, const float* smooth, int taps, \
+                                int cols, float* d, float* s) \
+{ rowPassBody(g, deriv, smooth, taps, cols, d, s); } \
+attributes void rowPassFixed_##name (const short* g, const short* deriv, const short* smooth, int taps, \
+                                     int cols, short* d, short* s) \
+{ rowPassBody(g, deriv, smooth, taps, cols, d, s); } \
+attributes void columnPass_##name (const float* dx, const float* sx, size_t stride, const float* deriv, \
+                                   const float* smooth, int taps, int cols, float* gx, float* gy) \
+{ columnPassBody(dx, sx, stride, deriv, smooth, taps, cols, gx, gy); } \
+attributes void columnPassFixed_##name (const short* dx, const short* sx, size_t stride, const short* deriv, \
+                                        const short* smooth, int taps, int cols, short* gx, short* gy) \
+{ columnPassBody(dx, sx, stride, deriv, smooth, taps, cols, gx, gy); } \
+attributes void magnitude_##name (const float* gx, const float* gy, int cols, float* magnitudes) \
+{ magnitudeBody(gx, gy, cols, magnitudes); } \
+attributes void squaredMagnitude_##name (const short* gx, const short* gy, int cols, int* squared) \
+{ squaredMagnitudeBody(gx, gy, cols, squared); } \
+attributes void angle_##name (const float* gx, const float* gy, int cols, float* angles) \
+{ angleBody(gx, gy, cols, angles); } \
+attributes void angleFixed_##name (const short* gx, const short* gy, int cols, float* angles) \
+{ angleBody(gx, gy, cols, angles); } \
+attributes void colorMap_##name (const float* angles, const float* magnitudes, float t, int cols, uchar* bgr) \
+{ colorMapBody(angles, magnitudes, t, cols, bgr); } \
+const HotKernels name##Kernels = {isa, rowPass_##name, rowPassFixed_##name, columnPass_##name, \
+                                  columnPassFixed_##name, magnitude_##name, squaredMagnitude_##name, \
+                                  angle_##name, angleFixed_##name, colorMap_##name};
+
+DEFINE_HOT_KERNELS(baseline, "baseline", )
+#if defined(__x86_64__) || defined(__i386__)
+#define ORIENT_HAVE_ISA_DISPATCH
+DEFINE_HOT_KERNELS(sse42, "sse4.2", __attribute__((target("sse4.2"))))
+DEFINE_HOT_KERNELS(avx2, "avx2", __attribute__((target("avx2"))))
+DEFINE_HOT_KERNELS(avx512, "avx512", __attribute__((target("avx512f,avx512bw,avx512vl"))))
+#endif
+
+// the kernels for an instruction set name, or 0 if this CPU (or build)
+// cannot run them
+const HotKernels* kernelsFor (const string& isa)
+{
+    if (isa == "baseline") {
+        return &baselineKernels;
+    }
+#ifdef ORIENT_HAVE_ISA_DISPATCH
+    __builtin_cpu_init();
+    if (isa == "sse4.2" && __builtin_cpu_supports("sse4.2")) {
+        return &sse42Kernels;
+    } else if (isa == "avx2" && __builtin_cpu_supports("avx2")) {
+        return &avx2Kernels;
+    } else if (isa == "avx512" && __builtin_cpu_supports("avx512f")
+               && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl")) {
+        return &avx512Kernels;
+    }
+#endif
+    return 0;
+}
+
+// the widest set this CPU runs
+const HotKernels* detectKernels ()
+{
+    const char* const isas[] = {"avx512", "avx2", "sse4.2"};
+    for (int i = 0; i < 3; ++i) {
+        if (const HotKernels* kernels = kernelsFor(isas[i])) {
+            return kernels;
+        }
+    }
+    return &baselineKernels;
+}
+
+// chosen before main runs; --isa replaces it
+const HotKernels* hotKernels = detectKernels();
+
+// BT.601 luma in the same 14-bit fixed point cvtColor uses for 8-bit images
+inline int greyLevel (int b, int g, int r)
+{
+    return (b * 1868 + g * 9617 + r * 4899 + 8192) >> 14;
+}
+
+template <typename T>
+void loadGreyRowOf (const Mat& coloredImage, int r, float* grey, bool rgbOrder)
+{
+    const int cols = coloredImage.cols;
+    const T* src = coloredImage.ptr<T>(r);
+    if (coloredImage.channels() == 1) {
         for (int c = 0; c < cols; ++c) {
-            imageOfMagnitudes.at<unsigned char>(r,c) = (unsigned char)(magnitudes.at<float>(r,c) / maxMagnitude * 255);
+            grey[c] = src[c];
         }
+        return;
+    }
+    const int blue = rgbOrder ? 2 : 0;
+    const int red = 2 - blue;
+    for (int c = 0; c < cols; ++c) {
+        grey[c] = 0.114f * src[3*c+blue] + 0.587f * src[3*c+1] + 0.299f * src[3*c+red];
     }
-    imwrite(imageName, imageOfMagnitudes);
 }
 
-int main(const int argc, const char* argv[])
+// converts row r of an 8-bit, 16-bit or float image (grey, BGR, or RGB with
+// rgbOrder set) to grey, reading the native depth directly rather than
+// through a converted copy
+void loadGreyRow (const Mat& coloredImage, int r, float* grey, bool rgbOrder)
 {
-    if (argc != 4) {
-        cout << "usage: file_name, num_of_iter, save_step_size" << endl;
-        return 0;
+    if (coloredImage.depth() == CV_8U) {
+        const int cols = coloredImage.cols;
+        const uchar* src = coloredImage.ptr<uchar>(r);
+        if (coloredImage.channels() == 1) {
+            for (int c = 0; c < cols; ++c) {
+                grey[c] = src[c];
+            }
+        } else {
+            const int blue = rgbOrder ? 2 : 0;
+            const int red = 2 - blue;
+            for (int c = 0; c < cols; ++c) {
+                grey[c] = greyLevel(src[3*c+blue], src[3*c+1], src[3*c+red]);
+            }
+        }
+    } else if (coloredImage.depth() == CV_16U) {
+        loadGreyRowOf<ushort>(coloredImage, r, grey, rgbOrder);
+    } else {
+        loadGreyRowOf<float>(coloredImage, r, grey, rgbOrder);
     }
+}
 
-    const string imageName = argv[1];
-    const int iterationTimes = atoi(argv[2]);
-    const int saveStep = atoi(argv[3]);
+// true for the pixel types loadGreyRow reads; anything else would be
+// misread rather than rejected by it
+bool readablePixelType (int type)
+{
+    const int depth = CV_MAT_DEPTH(type);
+    const int channels = CV_MAT_CN(type);
+    return (depth == CV_8U || depth == CV_16U || depth == CV_32F) && (channels == 1 || channels == 3);
+}
 
-    Mat coloredImage = imread(imageName, CV_LOAD_IMAGE_COLOR);
-    Mat angles, magnitudes;
-    calcGradients(imageName, angles, magnitudes);
-    saveAngleGraph(imageName+"_original_grad.jpg", angles, magnitudes, 0.0f);
+// computes rows [r0, r1) of angles and magnitudes straight from the BGR
+// image: the band plus its halo is converted to grey and run through the
+// horizontal pass into two band-sized buffers, then the vertical pass
+// produces angle and magnitude. no full-resolution intermediate is made.
+// borders are reflected (BORDER_REFLECT_101) like OpenCV's filters.
+// with rawGradients set, gx and gy are written to the two outputs instead.
+void calcGradientBand (const Mat& coloredImage, const GradientKernel& kernel, int r0, int r1,
+                       Mat& angles, Mat& magnitudes, vector<float>& buffer,
+                       bool rawGradients=false, bool rgbOrder=false)
+{
+    const int rows = coloredImage.rows;
+    const int cols = coloredImage.cols;
+    const int R = kernel.radius;
+    const int taps = 2*R + 1;
+    const int haloRows = r1 - r0 + 2*R;
+    buffer.resize(cols + 2*R + (2 * size_t(haloRows) + 2) * cols);
+    float* grey = &buffer[0] + R;
+    float* dx = grey + cols + R;
+    float* sx = dx + size_t(haloRows) * cols;
+    float* gx = sx + size_t(haloRows) * cols;
+    float* gy = gx + cols;
 
-    Mat nextAngles = angles.clone();
-    Mat nextMagnitudes = magnitudes.clone();
+    for (int i = 0; i < haloRows; ++i) {
+        loadGreyRow(coloredImage, borderInterpolate(r0 - R + i, rows, BORDER_REFLECT_101), grey, rgbOrder);
+        for (int j = 1; j <= R; ++j) {
+            grey[-j] = grey[borderInterpolate(-j, cols, BORDER_REFLECT_101)];
+            grey[cols-1+j] = grey[borderInterpolate(cols-1+j, cols, BORDER_REFLECT_101)];
+        }
+        hotKernels->rowPass(grey - R, &kernel.deriv[0], &kernel.smooth[0], taps, cols,
+                            dx + size_t(i) * cols, sx + size_t(i) * cols);
+    }
 
-    for (int i = 0; i < iterationTimes; ++i) {
-        cout << "iter " << i+1 << endl;
-        iterate(5, angles, magnitudes, nextAngles, nextMagnitudes, coloredImage);
-        if ((i+1) % saveStep == 0) {
-            string outName = imageName + "_" + to_string(i+1) + "_iter";
-            saveAngleToFile(outName + ".txt", angles);
-            saveAngleGraph(outName + ".jpg", angles, magnitudes, 0.0f);
+    for (int i = 0; i < r1 - r0; ++i) {
+        float* angleRow = angles.ptr<float>(r0 + i);
+        float* magnitudeRow = magnitudes.ptr<float>(r0 + i);
+        if (rawGradients) {
+            hotKernels->columnPass(dx + size_t(i) * cols, sx + size_t(i) * cols, cols, &kernel.deriv[0],
+                                   &kernel.smooth[0], taps, cols, angleRow, magnitudeRow);
+            continue;
         }
+        hotKernels->columnPass(dx + size_t(i) * cols, sx + size_t(i) * cols, cols, &kernel.deriv[0],
+                               &kernel.smooth[0], taps, cols, gx, gy);
+        hotKernels->angle(gx, gy, cols, angleRow);
+        hotKernels->magnitude(gx, gy, cols, magnitudeRow);
     }
-    return 0;
 }
 
-// h in rad
-Vec3b hsv2rgb (float h, float s, float v)
-{
-    float ah = (h + PI/2) / PI * 360;
-    int hi = int(ah / 60);
-    float f = ah / 60 - hi;
-    float p = v * (1 - s);
-    float q = v * (1 - f * s);
-    float t = v * (1 - (1 - f) * s);
-    if (hi == 0) {
-        return Vec3b(v*255, t*255, p*255);
-    } else if (hi == 1) {
-        return Vec3b(q*255, v*255, p*255);
-    } else if (hi == 2) {
-        return Vec3b(p*255, v*255, t*255);
-    } else if (hi == 3) {
-        return Vec3b(p*255, q*255, v*255);
-    } else if (hi == 4) {
-        return Vec3b(t*255, p*255, v*255);
-    } else if (hi == 5 || ah == 360) {
-        return Vec3b(v*255, p*255, q*255);
-    } else {
-        return Vec3b(0, 0, 0);
-        std::cerr << "error angle:" << hi << std::endl;
-        // throw(h/(PI*2)*360);
+// whether every intermediate of op on 8-bit input fits in int16: the
+// horizontal pass is bounded by 255 * sum|taps| and the vertical pass by
+// that times the other kernel's sum|taps|. holds for all but sobel7.
+bool fitsFixedPoint (GradientOperator op)
+{
+    if (op == GRADIENT_TENSOR) {
+        return false;
+    }
+    const GradientKernel& kernel = gradientKernel(op);
+    float derivSum = 0.0f, smoothSum = 0.0f;
+    for (size_t t = 0; t < kernel.deriv.size(); ++t) {
+        derivSum += fabs(kernel.deriv[t]);
+        smoothSum += fabs(kernel.smooth[t]);
+    }
+    return 255 * derivSum * smoothSum <= 32767;
+}
+
+// calcGradientBand for 8-bit input in int16: grey levels, both passes and
+// gx/gy stay 16-bit (twice the SIMD lanes of float), |g|^2 is accumulated
+// in int32, and only the final angle and magnitude are converted to float.
+// gx and gy are exact integers on both paths, so they agree with the float
+// path up to the rounding of the float magnitude.
+void calcGradientBandFixed (const Mat& coloredImage, const GradientKernel& kernel, int r0, int r1,
+                            Mat& angles, Mat& magnitudes, vector<short>& buffer, vector<int>& squared,
+                            bool rgbOrder)
+{
+    const int rows = coloredImage.rows;
+    const int cols = coloredImage.cols;
+    const int R = kernel.radius;
+    const int taps = 2*R + 1;
+    const int haloRows = r1 - r0 + 2*R;
+    buffer.resize(cols + 2*R + (2 * size_t(haloRows) + 2) * cols + 2*taps);
+    short* grey = &buffer[0] + R;
+    short* dx = grey + cols + R;
+    short* sx = dx + size_t(haloRows) * cols;
+    short* gx = sx + size_t(haloRows) * cols;
+    short* gy = gx + cols;
+    short* deriv = gy + cols;
+    short* smooth = deriv + taps;
+    copy(kernel.deriv.begin(), kernel.deriv.end(), deriv);
+    copy(kernel.smooth.begin(), kernel.smooth.end(), smooth);
+    squared.resize(cols);
+
+    const int blue = rgbOrder ? 2 : 0;
+    const int red = 2 - blue;
+    for (int i = 0; i < haloRows; ++i) {
+        const uchar* src = coloredImage.ptr<uchar>(borderInterpolate(r0 - R + i, rows, BORDER_REFLECT_101));
+        if (coloredImage.channels() == 1) {
+            for (int c = 0; c < cols; ++c) {
+                grey[c] = src[c];
+            }
+        } else {
+            for (int c = 0; c < cols; ++c) {
+                grey[c] = greyLevel(src[3*c+blue], src[3*c+1], src[3*c+red]);
+            }
+        }
+        for (int j = 1; j <= R; ++j) {
+            grey[-j] = grey[borderInterpolate(-j, cols, BORDER_REFLECT_101)];
+            grey[cols-1+j] = grey[borderInterpolate(cols-1+j, cols, BORDER_REFLECT_101)];
+        }
+        hotKernels->rowPassFixed(grey - R, deriv, smooth, taps, cols,
+                                 dx + size_t(i) * cols, sx + size_t(i) * cols);
+    }
+
+    for (int i = 0; i < r1 - r0; ++i) {
+        hotKernels->columnPassFixed(dx + size_t(i) * cols, sx + size_t(i) * cols, cols, deriv,
+                                    smooth, taps, cols, gx, gy);
+        hotKernels->squaredMagnitude(gx, gy, cols, &squared[0]);
+        float* angleRow = angles.ptr<float>(r0 + i);
+        float* magnitudeRow = magnitudes.ptr<float>(r0 + i);
+        hotKernels->angleFixed(gx, gy, cols, angleRow);
+        for (int c = 0; c < cols; ++c) {
+            magnitudeRow[c] = sqrt(float(squared[c]));
+        }
+    }
+}
+
+// structure tensor orientation: the outer products of the scharr gradients
+// are smoothed with a gaussian (sigma in pixels) and the dominant eigenvector
+// gives the gradient direction, rotated by pi/2 into the same edge
+// orientation calcGradients reports. the magnitude is sqrt of the largest
+// eigenvalue, which matches the gradient magnitude on a clean edge.
+void calcStructureTensor (const Mat& coloredImage, Mat& angles, Mat& magnitudes, float sigma, bool rgbOrder)
+{
+    const int rows = coloredImage.rows;
+    const int cols = coloredImage.cols;
+    Mat gradX(rows, cols, CV_32F), gradY(rows, cols, CV_32F);
+    const GradientKernel& kernel = gradientKernel(GRADIENT_SCHARR);
+    const int bandRows = min(64, max(4, 32768 / max(1, cols)));
+    const int numBands = (rows + bandRows - 1) / bandRows;
+    #pragma omp parallel
+    {
+        vector<float> buffer;
+        #pragma omp for schedule(dynamic)
+        for (int b = 0; b < numBands; ++b) {
+            calcGradientBand(coloredImage, kernel, b * bandRows, min(rows, (b+1) * bandRows),
+                             gradX, gradY, buffer, true, rgbOrder);
+        }
+    }
+
+    Mat jxx, jxy, jyy;
+    multiply(gradX, gradX, jxx);
+    multiply(gradX, gradY, jxy);
+    multiply(gradY, gradY, jyy);
+    GaussianBlur(jxx, jxx, Size(), sigma);
+    GaussianBlur(jxy, jxy, Size(), sigma);
+    GaussianBlur(jyy, jyy, Size(), sigma);
+
+    angles.create(rows, cols, CV_32F);
+    magnitudes.create(rows, cols, CV_32F);
+    #pragma omp parallel for
+    for (int r = 0; r < rows; ++r) {
+        for (int c = 0; c < cols; ++c) {
+            float xx = jxx.at<float>(r,c);
+            float xy = jxy.at<float>(r,c);
+            float yy = jyy.at<float>(r,c);
+            float angle = 0.5f * atan2(2 * xy, xx - yy) + PI/2;
+            if (angle >= PI/2) {
+                angle -= PI;
+            }
+            float lambda = 0.5f * (xx + yy) + sqrt(0.25f * (xx - yy) * (xx - yy) + xy * xy);
+            angles.at<float>(r,c) = angle;
+            magnitudes.at<float>(r,c) = sqrt(lambda);
+        }
     }
 }
+
+// takes the decoded color image, so callers never have to decode the file
+// twice. work is split into bands sized to keep their buffers in L2.
+// fixedPoint selects the int16 path when the input is 8-bit and op fits it.
+// rgbOrder marks 3-channel input stored as RGB (mapped PPM files).
+void calcGradients (const Mat& coloredImage, Mat& angles, Mat& magnitudes,
+                    GradientOperator op, bool fixedPoint, bool rgbOrder)
+{
+    if (op == GRADIENT_TENSOR) {
+        calcStructureTensor(coloredImage, angles, magnitudes, 1.5f, rgbOrder);
+        return;
+    }
+    const int rows = coloredImage.rows;
+    const int cols = coloredImage.cols;
+    const GradientKernel& kernel = gradientKernel(op);
+    const int bandRows = min(64, max(4, 32768 / max(1, cols)));
+    const int numBands = (rows + bandRows - 1) / bandRows;
+    fixedPoint = fixedPoint && coloredImage.depth() == CV_8U && fitsFixedPoint(op);
+
+    angles.create(rows, cols, CV_32F);
+    magnitudes.create(rows, cols, CV_32F);
+    #pragma omp parallel
+    {
+        // kept by each thread across calls, so repeated gradients (the
+        // library's) allocate nothing once the buffers have grown
+        static thread_local vector<float> buffer;
+        static thread_local vector<short> fixedBuffer;
+        static thread_local vector<int> squared;
+        #pragma omp for schedule(dynamic)
+        for (int b = 0; b < numBands; ++b) {
+            const int r0 = b * bandRows;
+            const int r1 = min(rows, (b+1) * bandRows);
+            if (fixedPoint) {
+                calcGradientBandFixed(coloredImage, kernel, r0, r1, angles, magnitudes, fixedBuffer, squared,
+                                      rgbOrder);
+            } else {
+                calcGradientBand(coloredImage, kernel, r0, r1, angles, magnitudes, buffer, false, rgbOrder);
+            }
+        }
+    }
+}
+
+void appendBigEndian (vector<uchar>& out, unsigned int value)
+{
+    out.push_back(value >> 24);
+    out.push_back(value >> 16);
+    out.push_back(value >> 8);
+    out.push_back(value);
+}
+
+void appendPngChunk (vector<uchar>& out, const char* type, const uchar* data, size_t length)
+{
+    appendBigEndian(out, length);
+    const size_t typeStart = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + length);
+    appendBigEndian(out, crc32(0, &out[typeStart], length + 4));
+}
+
+// encodes an 8-bit grey or BGR image as a standard PNG whose horizontal
+// strips are filtered and deflated concurrently. every strip but the last
+// ends with a sync flush, which byte-aligns it, so the raw deflate streams
+// simply concatenate into one zlib stream (the pigz approach); the strip
+// adler32s are merged with adler32_combine. strips lose the preceding
+// strip's dictionary, which costs a little compression on large images.
+bool encodePngParallel (const Mat& image, vector<uchar>& png)
+{
+    if (image.depth() != CV_8U || (image.channels() != 1 && image.channels() != 3)) {
+        return false;
+    }
+    const int rows = image.rows;
+    const int cols = image.cols;
+    const int channels = image.channels();
+    const size_t rowBytes = size_t(cols) * channels + 1;
+    // a strip is one deflate call, whose input length is a uInt; rows
+    // longer than that go to imencode
+    if (rowBytes > UINT_MAX) {
+        return false;
+    }
+    const int stripRows = max(1, int((1 << 20) / rowBytes));
+    const int numStrips = (rows + stripRows - 1) / stripRows;
+    vector<vector<uchar> > compressed(numStrips);
+    vector<uLong> checksums(numStrips);
+    // written by one thread per strip and read after the loop
+    vector<uchar> stripOk(numStrips, 1);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int s = 0; s < numStrips; ++s) {
+        const int r0 = s * stripRows;
+        const int r1 = min(rows, r0 + stripRows);
+        // sub filter: each byte minus the same channel of the previous pixel,
+        // with BGR turned into PNG's RGB on the way
+        vector<uchar> raw(rowBytes * (r1 - r0));
+        for (int r = r0; r < r1; ++r) {
+            const uchar* src = image.ptr<uchar>(r);
+            uchar* dst = &raw[rowBytes * (r - r0)];
+            dst[0] = 1;
+            for (int c = 0; c < cols; ++c) {
+                for (int ch = 0; ch < channels; ++ch) {
+                    const int from = channels == 3 ? 2 - ch : ch;
+                    const uchar left = c > 0 ? src[(c-1) * channels + from] : 0;
+                    dst[1 + c * channels + ch] = src[c * channels + from] - left;
+                }
+            }
+        }
+        checksums[s] = adler32(adler32(0, 0, 0), &raw[0], raw.size());
+
+        z_stream stream;
+        stream.zalloc = 0;
+        stream.zfree = 0;
+        stream.opaque = 0;
+        if (deflateInit2(&stream, 3, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            stripOk[s] = 0;
+            continue;
+        }
+        compressed[s].resize(deflateBound(&stream, raw.size()) + 16);
+        stream.next_in = &raw[0];
+        stream.avail_in = raw.size();
+        stream.next_out = &compressed[s][0];
+        stream.avail_out = compressed[s].size();
+        const int status = deflate(&stream, s == numStrips - 1 ? Z_FINISH : Z_SYNC_FLUSH);
+        if (stream.avail_in != 0 || (status != Z_OK && status != Z_STREAM_END)) {
+            stripOk[s] = 0;
+        }
+        compressed[s].resize(stream.total_out);
+        deflateEnd(&stream);
+    }
+    if (find(stripOk.begin(), stripOk.end(), 0) != stripOk.end()) {
+        return false;
+    }
+
+    uLong checksum = adler32(0, 0, 0);
+    vector<uchar> idat;
+    idat.push_back(0x78);
+    idat.push_back(0x9c);
+    for (int s = 0; s < numStrips; ++s) {
+        const size_t stripLength = rowBytes * size_t(min(rows, (s+1) * stripRows) - s * stripRows);
+        checksum = adler32_combine(checksum, checksums[s], z_off_t(stripLength));
+        idat.insert(idat.end(), compressed[s].begin(), compressed[s].end());
+        vector<uchar>().swap(compressed[s]);
+    }
+    appendBigEndian(idat, checksum);
+
+    const uchar signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    png.assign(signature, signature + 8);
+    vector<uchar> header;
+    appendBigEndian(header, cols);
+    appendBigEndian(header, rows);
+    header.push_back(8);
+    header.push_back(channels == 3 ? 2 : 0);
+    header.push_back(0);
+    header.push_back(0);
+    header.push_back(0);
+    appendPngChunk(png, "IHDR", &header[0], header.size());
+    const size_t maxChunk = 1 << 30;
+    for (size_t pos = 0; pos < idat.size(); pos += maxChunk) {
+        appendPngChunk(png, "IDAT", &idat[pos], min(maxChunk, idat.size() - pos));
+    }
+    appendPngChunk(png, "IEND", 0, 0);
+    return true;
+}
+
+// encodes image in the format of fileName's extension; .png files go
+// through the parallel strip encoder
+bool encodeImage (const string& fileName, const Mat& image, vector<uchar>& bytes)
+{
+    const size_t dot = fileName.rfind('.');
+    if (dot == string::npos) {
+        return false;
+    }
+    if (fileName.substr(dot) == ".png" && encodePngParallel(image, bytes)) {
+        return true;
+    }
+    return imencode(fileName.substr(dot), image, bytes);
+}
+
+// imwrite, except that .png files go through the parallel strip encoder
+bool writeImage (const string& fileName, const Mat& image)
+{
+    vector<uchar> bytes;
+    if (!encodeImage(fileName, image, bytes)) {
+        return imwrite(fileName, image);
+    }
+    ofstream out(fileName.c_str(), ios::binary);
+    out.write(reinterpret_cast<const char*>(&bytes[0]), bytes.size());
+    return bool(out);
+}
+
+// returns the BGR orientation map of pixels stronger than t, black elsewhere
+Mat renderAngleTile (const Mat& angles, const Mat& magnitudes, float t)
+{
+    const int rows = angles.rows;
+    const int cols = angles.cols;
+
+    Mat imageOfAngles = Mat(rows, cols, CV_8UC3);
+
+    // #pragma omp parallel for
+    for (int r = 0; r < rows; ++r) {
+        hotKernels->colorMap(angles.ptr<float>(r), magnitudes.ptr<float>(r), t, cols,
+                             imageOfAngles.ptr<uchar>(r));
+    }
+    return imageOfAngles;
+}
+
+// returns the BGR orientation map, ready for imwrite
+Mat renderAngleGraph (const Mat& angles, const Mat& magnitudes, float threshold=0.0f)
+{
+    double maxMagnitude;
+    minMaxLoc(magnitudes, 0, &maxMagnitude);
+    return renderAngleTile(angles, magnitudes, maxMagnitude * threshold);
+}
+
+void saveAngleGraph (const string& imageName, const Mat& angles,
+                     const Mat& magnitudes, float threshold=0.0f)
+{
+    Mat imageOfAngles = renderAngleGraph(angles, magnitudes, threshold);
+    cout << "saving " << imageName << endl;
+    writeImage(imageName, imageOfAngles);
+}
+
+// halves an orientation field by averaging each 2x2 block (whatever part of
+// it exists on odd edges). the field is CV_32FC3 (m cos 2a, m sin 2a, m), so
+// orientations are averaged as doubled-angle vectors, not as colors.
+Mat reduceOrientationField (const Mat& field)
+{
+    const int rows = (field.rows + 1) / 2;
+    const int cols = (field.cols + 1) / 2;
+    Mat reduced(rows, cols, CV_32FC3);
+    #pragma omp parallel for
+    for (int r = 0; r < rows; ++r) {
+        for (int c = 0; c < cols; ++c) {
+            Vec3f sum(0, 0, 0);
+            int count = 0;
+            for (int rr = 2*r; rr < min(2*r+2, field.rows); ++rr) {
+                for (int cc = 2*c; cc < min(2*c+2, field.cols); ++cc) {
+                    sum += field.at<Vec3f>(rr,cc);
+                    ++count;
+                }
+            }
+            reduced.at<Vec3f>(r,c) = sum * (1.0f / count);
+        }
+    }
+    return reduced;
+}
+
+// the first reduction, straight from angles and magnitudes so no
+// full-resolution vector field is ever built
+Mat reduceAngles (const Mat& angles, const Mat& magnitudes)
+{
+    const int rows = (angles.rows + 1) / 2;
+    const int cols = (angles.cols + 1) / 2;
+    Mat reduced(rows, cols, CV_32FC3);
+    #pragma omp parallel for
+    for (int r = 0; r < rows; ++r) {
+        for (int c = 0; c < cols; ++c) {
+            Vec3f sum(0, 0, 0);
+            int count = 0;
+            for (int rr = 2*r; rr < min(2*r+2, angles.rows); ++rr) {
+                for (int cc = 2*c; cc < min(2*c+2, angles.cols); ++cc) {
+                    float m = magnitudes.at<float>(rr,cc);
+                    float a = 2 * angles.at<float>(rr,cc);
+                    sum += Vec3f(m * cos(a), m * sin(a), m);
+                    ++count;
+                }
+            }
+            reduced.at<Vec3f>(r,c) = sum * (1.0f / count);
+        }
+    }
+    return reduced;
+}
+
+void fieldToAngles (const Mat& field, Mat& angles, Mat& magnitudes)
+{
+    angles.create(field.rows, field.cols, CV_32F);
+    magnitudes.create(field.rows, field.cols, CV_32F);
+    #pragma omp parallel for
+    for (int r = 0; r < field.rows; ++r) {
+        for (int c = 0; c < field.cols; ++c) {
+            const Vec3f& v = field.at<Vec3f>(r,c);
+            float angle = 0.5f * atan2(v[1], v[0]);
+            if (angle >= PI/2) {
+                angle -= PI;
+            }
+            angles.at<float>(r,c) = angle;
+            magnitudes.at<float>(r,c) = v[2];
+        }
+    }
+}
+
+// writes the orientation map as a Deep Zoom pyramid: baseName.dzi plus
+// baseName_files/<level>/<col>_<row>.jpeg, 256px tiles without overlap.
+// level maxLevel is full resolution and each level below halves it down to
+// 1x1. tiles of a level are rendered and encoded in parallel.
+void saveAnglePyramid (const string& baseName, const Mat& angles,
+                       const Mat& magnitudes, float threshold=0.0f)
+{
+    const int tileSize = 256;
+    const int rows = angles.rows;
+    const int cols = angles.cols;
+    int maxLevel = 0;
+    while ((1 << maxLevel) < max(rows, cols)) {
+        ++maxLevel;
+    }
+    double maxMagnitude;
+    minMaxLoc(magnitudes, 0, &maxMagnitude);
+    const float t = maxMagnitude * threshold;
+
+    cout << "saving " << baseName << ".dzi" << endl;
+    const string tileDir = baseName + "_files";
+    mkdir(tileDir.c_str(), 0755);
+    ofstream descriptor(baseName + ".dzi");
+    descriptor << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" << endl
+               << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"jpeg\" Overlap=\"0\" TileSize=\""
+               << tileSize << "\">" << endl
+               << "  <Size Width=\"" << cols << "\" Height=\"" << rows << "\"/>" << endl
+               << "</Image>" << endl;
+    descriptor.close();
+
+    Mat field;
+    for (int level = maxLevel; level >= 0; --level) {
+        Mat levelAngles = angles, levelMagnitudes = magnitudes;
+        if (level < maxLevel) {
+            field = level == maxLevel - 1 ? reduceAngles(angles, magnitudes) : reduceOrientationField(field);
+            fieldToAngles(field, levelAngles, levelMagnitudes);
+        }
+        const string levelDir = tileDir + "/" + to_string(level);
+        mkdir(levelDir.c_str(), 0755);
+        const int tileRows = (levelAngles.rows + tileSize - 1) / tileSize;
+        const int tileCols = (levelAngles.cols + tileSize - 1) / tileSize;
+        #pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < tileRows * tileCols; ++i) {
+            const int tr = i / tileCols;
+            const int tc = i % tileCols;
+            Rect area(tc * tileSize, tr * tileSize,
+                      min(tileSize, levelAngles.cols - tc * tileSize),
+                      min(tileSize, levelAngles.rows - tr * tileSize));
+            Mat tile = renderAngleTile(levelAngles(area), levelMagnitudes(area), t);
+            imwrite(levelDir + "/" + to_string(tc) + "_" + to_string(tr) + ".jpeg", tile);
+        }
+    }
+}
+
+void saveAngleGreyGraph (const string& imageName, const Mat& angles)
+{
+    const int rows = angles.rows;
+    const int cols = angles.cols;
+    Mat imageOfAngles = Mat(rows, cols, CV_8U);
+
+    for (int r = 0; r < rows; ++r) {
+        for (int c = 0; c < cols; ++c) {
+            float ratio = (angles.at<float>(r,c) + PI/2) / PI;
+            if (ratio > 1.0f) {
+                cout << "saveAngleGreyGraph: " << r << ", " << c << ", ratio: " << ratio << endl;
+                ratio = 1.0f;
+            } else if (ratio < 0.0f) {
+                cout << "saveAngleGreyGraph: " << r << ", " << c << ", ratio: " << ratio << endl;
+                ratio = 0.0f;
+            }
+            // unsigned char greyVal = ratio * 255;
+            imageOfAngles.at<unsigned char>(r,c) = (unsigned char) (ratio * 255);
+        }
+    }
+    writeImage(imageName, imageOfAngles);
+}
+
+// appends rows to a stream in saveAngleToFile's format
+void appendAngleRows (ostream& out, const Mat& angles)
+{
+    for (int r = 0; r < angles.rows; ++r) {
+        for (int c = 0; c < angles.cols; ++c) {
+            out << angles.at<float>(r,c) << " ";
+        }
+        out << endl;
+    }
+}
+
+void writeAngles (ostream& out, const Mat& angles)
+{
+    out << angles.rows << " " << angles.cols << endl;
+    appendAngleRows(out, angles);
+}
+
+void saveAngleToFile (const string& fileName, const Mat& angles)
+{
+    ofstream out_file(fileName);
+    writeAngles(out_file, angles);
+    out_file.close();
+}
+
+void saveMagnitudeGraph (const string& imageName, const Mat& magnitudes)
+{
+    const int rows = magnitudes.rows;
+    const int cols = magnitudes.cols;
+
+    Mat imageOfMagnitudes = Mat(rows, cols, CV_8U);
+    double maxMagnitude;
+    minMaxLoc(magnitudes, 0, &maxMagnitude);
+
+    // #pragma omp parallel for
+    for (int r = 0; r < rows; ++r) {
+        for (int c = 0; c < cols; ++c) {
+            imageOfMagnitudes.at<unsigned char>(r,c) = (unsigned char)(magnitudes.at<float>(r,c) / maxMagnitude * 255);
+        }
+    }
+    writeImage(imageName, imageOfMagnitudes);
+}
+
+bool readAll (int fd, void* data, size_t bytes)
+{
+    char* p = static_cast<char*>(data);
+    while (bytes > 0) {
+        const ssize_t n = read(fd, p, bytes);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+bool writeAll (int fd, const void* data, size_t bytes)
+{
+    const char* p = static_cast<const char*>(data);
+    while (bytes > 0) {
+        const ssize_t n = write(fd, p, bytes);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+// imread flags for --preview-scale: IMREAD_REDUCED_* lets the JPEG decoder
+// scale in the DCT domain, so a 1/8 preview never decodes the full image.
+// other formats are decoded and then area-resized by OpenCV.
+int previewReadFlags (int previewScale)
+{
+    switch (previewScale) {
+    case 2:
+        return IMREAD_REDUCED_COLOR_2 | IMREAD_ANYDEPTH;
+    case 4:
+        return IMREAD_REDUCED_COLOR_4 | IMREAD_ANYDEPTH;
+    case 8:
+        return IMREAD_REDUCED_COLOR_8 | IMREAD_ANYDEPTH;
+    default:
+        return IMREAD_COLOR | IMREAD_ANYDEPTH;
+    }
+}
+
+// preview reduction for inputs that were not decoded through imread
+void shrinkForPreview (Mat& image, int previewScale)
+{
+    if (previewScale > 1) {
+        Mat reduced;
+        resize(image, reduced, Size(), 1.0 / previewScale, 1.0 / previewScale, INTER_AREA);
+        image = reduced;
+    }
+}
+
+// the comma separated numbers of text; an item that is not a number becomes
+// NaN, which fails every range check
+vector<float> parseList (const string& text)
+{
+    vector<float> values;
+    stringstream ss(text);
+    string item;
+    while (getline(ss, item, ',')) {
+        char* end;
+        const float value = strtof(item.c_str(), &end);
+        values.push_back(end != item.c_str() && *end == '\0' ? value : NAN);
+    }
+    return values;
+}
+
+bool SweepGrid::enabled () const
+{
+    return !kernelSizes.empty() || !spatialSigmas.empty()
+        || !colorSigmas.empty() || !iterations.empty();
+}
+
+// false (after saying why) if option's list holds a value it cannot take:
+// every value is positive, and whole (and odd) where asked
+bool checkList (const string& option, const vector<float>& values, bool whole, bool odd)
+{
+    for (size_t i = 0; i < values.size(); ++i) {
+        const float value = values[i];
+        if (!(value > 0) || (whole && (value != floor(value) || value > 1e6f)) || (odd && int(value) % 2 == 0)) {
+            cout << option << " takes positive " << (odd ? "odd " : "") << (whole ? "integers" : "numbers") << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+Options::Options ()
+    : iterationTimes(0)
+    , saveStep(1)
+    , filterParams(defaultFilterParams)
+    , sequence(false)
+    , warmIterations(-1)
+    , warmBlend(0.5f)
+    , engine("exact")
+    , compareEngines(false)
+    , gradient(GRADIENT_SCHARR)
+    , benchGradients(false)
+    , fixedPoint(false)
+    , stream(false)
+    , strips(false)
+    , bands(1)
+    , transport("shm")
+    , coordinator(false)
+    , leaseSeconds(60)
+    , dzi(false)
+    , videoCodec("MJPG")
+    , imageExtension(".jpg")
+    , previewScale(1)
+    , pack(0)
+    , autotune(false)
+    , syntheticRows(0)
+    , syntheticCols(0)
+    , checkDeterminism(false)
+    , directIo(false)
+    , io(0)
+    , budgetSeconds(0) {}
+
+// snapshot writers honouring --pack and --async-io, defined with the file I/O
+void saveAngles (const Options& options, const string& fileName, const Mat& angles);
+void saveMap (const Options& options, const string& imageName, const Mat& angles, const Mat& magnitudes);
+void saveRendered (const Options& options, const string& imageName, const Mat& graph);
+
+void printUsage ()
+{
+    cout << "usage: file_name, num_of_iter, save_step_size [options]" << endl
+         << "  --kernel-size k             bilateral window, odd (default 5)" << endl
+         << "  --spatial-sigma s           spatial sigma in pixels, the grid engine's cell size (default 2)" << endl
+         << "  --color-sigma s             color sigma in 8-bit grey levels (default 10)" << endl
+         << "  --sweep-kernel k1,k2,...    sweep kernel sizes" << endl
+         << "  --sweep-spatial s1,s2,...   sweep spatial sigmas" << endl
+         << "  --sweep-color s1,s2,...     sweep color sigmas" << endl
+         << "  --sweep-iters n1,n2,...     sweep iteration counts" << endl
+         << "  --sequence                  file_name is a video or numbered image pattern" << endl
+         << "  --warm-iters n              iterations per frame after the first (sequence)" << endl
+         << "  --warm-blend w              weight of the previous frame's field (sequence)" << endl
+         << "  --engine exact|grid         per-pixel bilateral filter or bilateral grid" << endl
+         << "  --compare-engines           time both engines and report their difference" << endl
+         << "  --gradient op               scharr, sobel3, sobel5, sobel7, central or tensor" << endl
+         << "  --bench-gradients           time every gradient operator on the image" << endl
+         << "  --fixed-point               int16 gradients for 8-bit input (not sobel7/tensor)" << endl
+         << "  --stream                    frames from stdin, fields to stdout (file_name: -)" << endl
+         << "  --raw rows,cols,type[,off]  file_name is headerless pixels, e.g. 8UC3 or 16UC1" << endl
+         << "  --strips                    decode and process the input strip by strip" << endl
+         << "  --bands n                   iterate in n worker processes, one band of rows each" << endl
+         << "  --transport shm|tcp         halo exchange between --bands workers (default shm)" << endl
+         << "  --spool dir                 claim jobs from a spool directory (file_name: -)" << endl
+         << "  --coordinator               with --spool: enqueue file_name's list of images" << endl
+         << "  --lease-seconds n           reclaim spool jobs without a heartbeat for n s" << endl
+         << "  --dzi                       write snapshots as Deep Zoom tile pyramids" << endl
+         << "  --video file                append snapshots as frames of one video instead" << endl
+         << "  --video-codec MJPG|FFV1     codec for --video (default MJPG)" << endl
+         << "  --png                       write maps as PNG, encoded in parallel strips" << endl
+         << "  --preview-scale 1/2|1/4|1/8 decode and run at reduced resolution" << endl
+         << "  --pack dir                  append snapshots to dir/<host>-<pid>.tar and its .idx" << endl
+         << "  --unpack name               file_name is a pack: write its member name to stdout" << endl
+         << "  --autotune                  time threads and tile shapes on a crop, cache the best" << endl
+         << "  --tune-cache file           where --autotune keeps results (default ~/.orient_tune)" << endl
+         << "  --isa set                   gradient and color map kernels: baseline, sse4.2, avx2 or avx512" << endl
+         << "                              instead of the widest set the CPU supports" << endl
+         << "  --synthetic rows,cols       time a run on a generated image (file_name: prefix)" << endl
+         << "  --check-determinism         check that 1 to all threads give bit-identical fields" << endl
+         << "  --async-io uring|threads    write snapshots (and read spool inputs ahead) asynchronously" << endl
+         << "  --direct-io                 with --async-io: large snapshots bypass the page cache" << endl
+         << "  --budget ms                 stop iterating after ms of wall-clock time (per frame" << endl
+         << "                              with --stream) and keep the field so far; SIGUSR1" << endl
+         << "                              stops the iterations in progress the same way" << endl;
+}
+
+// returns false (after saying why) on a malformed command line
+bool parseOptions (const int argc, const char* argv[], Options& options)
+{
+    if (argc < 4) {
+        printUsage();
+        return false;
+    }
+    options.imageName = argv[1];
+    options.iterationTimes = atoi(argv[2]);
+    options.saveStep = atoi(argv[3]);
+
+    for (int i = 4; i < argc; ++i) {
+        const string arg = argv[i];
+        if (arg == "--sequence") {
+            options.sequence = true;
+            continue;
+        } else if (arg == "--compare-engines") {
+            options.compareEngines = true;
+            continue;
+        } else if (arg == "--bench-gradients") {
+            options.benchGradients = true;
+            continue;
+        } else if (arg == "--fixed-point") {
+            options.fixedPoint = true;
+            continue;
+        } else if (arg == "--stream") {
+            options.stream = true;
+            continue;
+        } else if (arg == "--dzi") {
+            options.dzi = true;
+            continue;
+        } else if (arg == "--strips") {
+            options.strips = true;
+            continue;
+        } else if (arg == "--coordinator") {
+            options.coordinator = true;
+            continue;
+        } else if (arg == "--check-determinism") {
+            options.checkDeterminism = true;
+            continue;
+        } else if (arg == "--autotune") {
+            options.autotune = true;
+            continue;
+        } else if (arg == "--direct-io") {
+            options.directIo = true;
+            continue;
+        } else if (arg == "--png") {
+            options.imageExtension = ".png";
+            continue;
+        }
+        if (i + 1 >= argc) {
+            cout << "missing value for " << arg << endl;
+            return false;
+        }
+        if (arg == "--sweep-kernel") {
+            options.sweep.kernelSizes = parseList(argv[++i]);
+        } else if (arg == "--sweep-spatial") {
+            options.sweep.spatialSigmas = parseList(argv[++i]);
+        } else if (arg == "--sweep-color") {
+            options.sweep.colorSigmas = parseList(argv[++i]);
+        } else if (arg == "--sweep-iters") {
+            options.sweep.iterations = parseList(argv[++i]);
+        } else if (arg == "--kernel-size" || arg == "--spatial-sigma" || arg == "--color-sigma") {
+            const vector<float> value = parseList(argv[++i]);
+            const bool kernel = arg == "--kernel-size";
+            if (value.size() != 1) {
+                cout << arg << " takes one value" << endl;
+                return false;
+            }
+            if (!checkList(arg, value, kernel, kernel)) {
+                return false;
+            }
+            if (kernel) {
+                options.filterParams.kernelSize = int(value[0]);
+            } else if (arg == "--spatial-sigma") {
+                options.filterParams.spatialSigma = value[0];
+            } else {
+                options.filterParams.colorSigma = value[0];
+            }
+        } else if (arg == "--warm-iters") {
+            options.warmIterations = atoi(argv[++i]);
+        } else if (arg == "--warm-blend") {
+            options.warmBlend = atof(argv[++i]);
+        } else if (arg == "--engine") {
+            options.engine = argv[++i];
+        } else if (arg == "--raw") {
+            options.rawSpec = argv[++i];
+        } else if (arg == "--bands") {
+            const vector<float> value = parseList(argv[++i]);
+            if (value.size() != 1) {
+                cout << arg << " takes one value" << endl;
+                return false;
+            }
+            if (!checkList(arg, value, true, false)) {
+                return false;
+            }
+            options.bands = int(value[0]);
+        } else if (arg == "--transport") {
+            options.transport = argv[++i];
+        } else if (arg == "--spool") {
+            options.spool = argv[++i];
+        } else if (arg == "--lease-seconds") {
+            options.leaseSeconds = max(1, atoi(argv[++i]));
+        } else if (arg == "--video") {
+            options.videoName = argv[++i];
+        } else if (arg == "--pack") {
+            options.packDir = argv[++i];
+        } else if (arg == "--async-io") {
+            options.ioBackend = argv[++i];
+            if (options.ioBackend != "uring" && options.ioBackend != "threads") {
+                cout << "unknown --async-io backend " << options.ioBackend << endl;
+                return false;
+            }
+        } else if (arg == "--budget") {
+            options.budgetSeconds = atof(argv[++i]) / 1000;
+            if (options.budgetSeconds <= 0) {
+                cout << "--budget takes a positive number of milliseconds" << endl;
+                return false;
+            }
+        } else if (arg == "--synthetic") {
+            const vector<float> size = parseList(argv[++i]);
+            if (size.size() != 2 || !(size[0] >= 1) || !(size[1] >= 1)) {
+                cout << "--synthetic takes rows,cols" << endl;
+                return false;
+            }
+            options.syntheticRows = int(size[0]);
+            options.syntheticCols = int(size[1]);
+        } else if (arg == "--isa") {
+            options.isa = argv[++i];
+        } else if (arg == "--tune-cache") {
+            options.tuneCache = argv[++i];
+        } else if (arg == "--unpack") {
+            options.unpackName = argv[++i];
+        } else if (arg == "--video-codec") {
+            options.videoCodec = argv[++i];
+        } else if (arg == "--preview-scale") {
+            const string scale = argv[++i];
+            if (scale != "1/2" && scale != "1/4" && scale != "1/8") {
+                cout << "preview scale must be 1/2, 1/4 or 1/8" << endl;
+                return false;
+            }
+            options.previewScale = scale[2] - '0';
+        } else if (arg == "--gradient") {
+            if (!parseGradientOperator(argv[++i], options.gradient)) {
+                cout << "unknown gradient operator " << argv[i] << endl;
+                return false;
+            }
+        } else {
+            cout << "unknown option " << arg << endl;
+            return false;
+        }
+    }
+
+    if (options.warmIterations < 0) {
+        options.warmIterations = max(1, options.iterationTimes / 4);
+    }
+    // every mode but these snapshots each save_step_size iterations (or
+    // frames); a spool worker takes it from each job instead
+    const bool snapshots = !options.stream && options.unpackName.empty()
+                           && (options.spool.empty() || options.coordinator);
+    if (snapshots && options.saveStep < 1) {
+        cout << "save_step_size must be a positive number" << endl;
+        return false;
+    }
+    if (options.engine != "exact" && options.engine != "grid") {
+        cout << "unknown engine " << options.engine << endl;
+        return false;
+    }
+    if (!checkList("--sweep-kernel", options.sweep.kernelSizes, true, true)
+        || !checkList("--sweep-spatial", options.sweep.spatialSigmas, false, false)
+        || !checkList("--sweep-color", options.sweep.colorSigmas, false, false)
+        || !checkList("--sweep-iters", options.sweep.iterations, true, false)) {
+        return false;
+    }
+    if (options.sweep.enabled() && options.sweep.iterations.empty() && options.iterationTimes < 1) {
+        cout << "a sweep without --sweep-iters needs a positive num_of_iter" << endl;
+        return false;
+    }
+    if (options.transport != "shm" && options.transport != "tcp") {
+        cout << "unknown transport " << options.transport << endl;
+        return false;
+    }
+    if (options.engine != "exact" && (options.bands > 1 || options.strips || options.sequence)) {
+        cout << "--bands, --strips and --sequence need the exact engine" << endl;
+        return false;
+    }
+    if (!options.isa.empty()) {
+        const HotKernels* kernels = kernelsFor(options.isa);
+        if (!kernels) {
+            cout << "this CPU cannot run the " << options.isa << " kernels" << endl;
+            return false;
+        }
+        hotKernels = kernels;
+    }
+    if (!options.packDir.empty() && (options.strips || options.dzi)) {
+        cout << "--pack holds whole snapshots, not the streamed ones of --strips or --dzi pyramids" << endl;
+        return false;
+    }
+    if (options.previewScale > 1 && (options.strips || options.stream)) {
+        cout << "--preview-scale covers decoded images and --sequence, not --strips or --stream" << endl;
+        return false;
+    }
+    if (options.budgetSeconds > 0 && (options.bands > 1 || options.strips || options.sequence)) {
+        cout << "--budget covers single images and --stream, not --bands, --strips or --sequence" << endl;
+        return false;
+    }
+    if (options.directIo && options.ioBackend.empty()) {
+        cout << "--direct-io needs --async-io" << endl;
+        return false;
+    }
+    if (options.fixedPoint && !fitsFixedPoint(options.gradient)) {
+        cout << "--fixed-point does not cover " << gradientOperatorNames[options.gradient] << ", using float" << endl;
+    }
+    return true;
+}
+
+string sweepTag (const FilterParams& params)
+{
+    stringstream ss;
+    ss << "k" << params.kernelSize << "_ss" << params.spatialSigma << "_sc" << params.colorSigma;
+    return ss.str();
+}
+
+// every (kernel, spatial sigma, color sigma) triple is iterated once up to the
+// largest requested iteration count and snapshotted at each requested count,
+// so configurations differing only in iterations share all of their work.
+// decode and gradients are computed by the caller once for the whole grid.
+void runSweep (const Options& options, const Mat& coloredImage, const Mat& angles, const Mat& magnitudes)
+{
+    SweepGrid grid = options.sweep;
+    const FilterParams& base = options.filterParams;
+    if (grid.kernelSizes.empty()) grid.kernelSizes.push_back(base.kernelSize);
+    if (grid.spatialSigmas.empty()) grid.spatialSigmas.push_back(base.spatialSigma);
+    if (grid.colorSigmas.empty()) grid.colorSigmas.push_back(base.colorSigma);
+    if (grid.iterations.empty()) grid.iterations.push_back(options.iterationTimes);
+    sort(grid.iterations.begin(), grid.iterations.end());
+
+    vector<FilterParams> configs;
+    for (size_t a = 0; a < grid.kernelSizes.size(); ++a) {
+        for (size_t b = 0; b < grid.spatialSigmas.size(); ++b) {
+            for (size_t c = 0; c < grid.colorSigmas.size(); ++c) {
+                configs.push_back(FilterParams(int(grid.kernelSizes[a]),
+                                               grid.spatialSigmas[b], grid.colorSigmas[c]));
+            }
+        }
+    }
+    const int numConfigs = configs.size();
+    const int numSnapshots = grid.iterations.size();
+    const int maxIterations = int(grid.iterations.back());
+    cout << "sweeping " << numConfigs << " configurations x " << numSnapshots << " iteration counts" << endl;
+
+    // thumbnails[config * numSnapshots + snapshot], laid out side by side at the end
+    vector<Mat> thumbnails(numConfigs * numSnapshots);
+    const double thumbScale = min(1.0, 512.0 / coloredImage.cols);
+
+    // with fewer configurations than threads the rows of each config are
+    // parallelized instead, inside iterate
+    #pragma omp parallel for schedule(dynamic) if(numConfigs >= maxThreads())
+    for (int i = 0; i < numConfigs; ++i) {
+        const FilterParams& params = configs[i];
+        const BilateralWeights weights(params, coloredImage.type());
+        Mat curAngles = angles.clone();
+        Mat curMagnitudes = magnitudes.clone();
+        Mat nextAngles = angles.clone();
+        Mat nextMagnitudes = magnitudes.clone();
+
+        int snapshot = 0;
+        for (int it = 1; it <= maxIterations; ++it) {
+            iterate(params, weights, curAngles, curMagnitudes, nextAngles, nextMagnitudes, coloredImage);
+            while (snapshot < numSnapshots && int(grid.iterations[snapshot]) == it) {
+                string outName = options.imageName + "_sweep_" + sweepTag(params) + "_" + to_string(it) + "_iter";
+                saveAngles(options, outName + ".txt", curAngles);
+                Mat graph = renderAngleGraph(curAngles, curMagnitudes, 0.0f);
+                saveRendered(options, outName + options.imageExtension, graph);
+                resize(graph, thumbnails[i * numSnapshots + snapshot], Size(), thumbScale, thumbScale, INTER_AREA);
+                ++snapshot;
+            }
+        }
+        #pragma omp critical
+        cout << "done " << sweepTag(params) << endl;
+    }
+
+    // one row per configuration, one column per iteration count
+    vector<Mat> rowsOfThumbnails;
+    for (int i = 0; i < numConfigs; ++i) {
+        vector<Mat> row;
+        for (int j = 0; j < numSnapshots; ++j) {
+            Mat thumb = thumbnails[i * numSnapshots + j];
+            putText(thumb, sweepTag(configs[i]) + " it" + to_string(int(grid.iterations[j])),
+                    Point(4, 16), FONT_HERSHEY_SIMPLEX, 0.4, Scalar(255, 255, 255));
+            row.push_back(thumb);
+        }
+        Mat joined;
+        hconcat(row, joined);
+        rowsOfThumbnails.push_back(joined);
+    }
+    Mat montage;
+    vconcat(rowsOfThumbnails, montage);
+    saveRendered(options, options.imageName + "_sweep" + options.imageExtension, montage);
+}
+
+// sums values[begin, end) as a balanced tree over leaves of at most 8, so
+// the rounding depends only on the number of values, never on the threads
+// that computed them
+double pairwiseSum (const vector<double>& values, size_t begin, size_t end)
+{
+    if (end - begin <= 8) {
+        double sum = 0.0;
+        for (size_t i = begin; i < end; ++i) {
+            sum += values[i];
+        }
+        return sum;
+    }
+    const size_t middle = begin + (end - begin) / 2;
+    return pairwiseSum(values, begin, middle) + pairwiseSum(values, middle, end);
+}
+
+// magnitude weighted mean orientation difference of angles from refAngles,
+// in degrees, and the share of pixels within 5 degrees. each row is summed
+// by one thread in column order and the row sums are combined pairwise, so
+// the figures are the same for any thread count.
+double orientationDeviation (const Mat& refAngles, const Mat& refMagnitudes, const Mat& angles,
+                             double* withinShare=0)
+{
+    const int rows = angles.rows;
+    const int cols = angles.cols;
+    vector<double> rowErrors(rows), rowWeights(rows), rowWithin(rows);
+    #pragma omp parallel for
+    for (int r = 0; r < rows; ++r) {
+        double sumError = 0.0, sumWeight = 0.0;
+        long within = 0;
+        for (int c = 0; c < cols; ++c) {
+            float d = fabs(refAngles.at<float>(r,c) - angles.at<float>(r,c));
+            d = min(d, float(PI) - d);
+            float w = refMagnitudes.at<float>(r,c);
+            sumError += d * w;
+            sumWeight += w;
+            if (d < 5.0 / 180.0 * PI) {
+                ++within;
+            }
+        }
+        rowErrors[r] = sumError;
+        rowWeights[r] = sumWeight;
+        rowWithin[r] = within;
+    }
+    if (withinShare) {
+        *withinShare = pairwiseSum(rowWithin, 0, rows) / max(size_t(1), angles.total());
+    }
+    return pairwiseSum(rowErrors, 0, rows) / max(pairwiseSum(rowWeights, 0, rows), 1e-12) / PI * 180;
+}
+
+// runs the exact and the grid engine side by side on the same gradients and
+// reports per-iteration time and how far the grid result drifts from the
+// exact one (magnitude weighted mean orientation error, and the share of
+// pixels within 5 degrees). the exact engine runs at params' kernel size and
+// at the one spanning the grid's support (3 spatial sigmas each way), the
+// large windows the grid is meant for
+void compareEngines (const Options& options, const Mat& coloredImage, bool rgbOrder,
+                     const Mat& angles, const Mat& magnitudes)
+{
+    const FilterParams& params = options.filterParams;
+    const int iterationTimes = options.iterationTimes;
+    Mat gridAngles = angles.clone(), gridMagnitudes = magnitudes.clone();
+    Mat nextAngles = angles.clone(), nextMagnitudes = magnitudes.clone();
+    const int iters = max(1, iterationTimes);
+    const string outName = options.imageName + "_" + to_string(iterationTimes) + "_iter";
+
+    int64 start = getTickCount();
+    BilateralGrid grid(coloredImage, params, rgbOrder);
+    for (int i = 0; i < iterationTimes; ++i) {
+        iterateGrid(grid, gridAngles, gridMagnitudes, nextAngles, nextMagnitudes);
+    }
+    const double gridSeconds = (getTickCount() - start) / getTickFrequency();
+    cout << "grid:  " << gridSeconds / iters * 1000 << " ms/iter (incl. setup)" << endl;
+    saveMap(options, outName + "_grid" + options.imageExtension, gridAngles, gridMagnitudes);
+
+    vector<int> kernelSizes(1, params.kernelSize);
+    const int support = 2 * int(ceil(3 * params.spatialSigma)) + 1;
+    if (support != params.kernelSize) {
+        kernelSizes.push_back(support);
+    }
+    for (size_t k = 0; k < kernelSizes.size(); ++k) {
+        const FilterParams exactParams(kernelSizes[k], params.spatialSigma, params.colorSigma);
+        Mat exactAngles = angles.clone(), exactMagnitudes = magnitudes.clone();
+        start = getTickCount();
+        const BilateralWeights weights(exactParams, coloredImage.type());
+        for (int i = 0; i < iterationTimes; ++i) {
+            iterate(exactParams, weights, exactAngles, exactMagnitudes, nextAngles, nextMagnitudes, coloredImage);
+        }
+        const double exactSeconds = (getTickCount() - start) / getTickFrequency();
+
+        double within = 0.0;
+        const double error = orientationDeviation(exactAngles, exactMagnitudes, gridAngles, &within);
+        cout << "exact k" << kernelSizes[k] << ": " << exactSeconds / iters * 1000 << " ms/iter, grid "
+             << exactSeconds / max(gridSeconds, 1e-9) << "x faster" << endl
+             << "  mean orientation error: " << error << " deg" << endl
+             << "  within 5 deg: " << 100.0 * within << " %" << endl;
+        saveMap(options, outName + "_exact_k" + to_string(kernelSizes[k]) + options.imageExtension, exactAngles,
+                exactMagnitudes);
+    }
+}
+
+// times every gradient operator on the image (best of 5 runs), on the int16
+// path too where it applies, and reports its magnitude weighted mean
+// orientation deviation from scharr
+void benchGradients (const Mat& coloredImage, bool rgbOrder)
+{
+    Mat refAngles, refMagnitudes;
+    calcGradients(coloredImage, refAngles, refMagnitudes, GRADIENT_SCHARR, false, rgbOrder);
+    const double megapixels = coloredImage.total() / 1e6;
+    cout << "kernels: " << hotKernels->isa << endl;
+
+    for (int i = 0; i < 2 * numGradientOperators; ++i) {
+        const GradientOperator op = GradientOperator(i / 2);
+        const bool fixedPoint = i % 2 == 1;
+        if (fixedPoint && (coloredImage.depth() != CV_8U || !fitsFixedPoint(op))) {
+            continue;
+        }
+        Mat angles, magnitudes;
+        double best = 1e30;
+        for (int run = 0; run < 5; ++run) {
+            int64 start = getTickCount();
+            calcGradients(coloredImage, angles, magnitudes, op, fixedPoint, rgbOrder);
+            best = min(best, (getTickCount() - start) / getTickFrequency());
+        }
+
+        cout << gradientOperatorNames[op] << (fixedPoint ? " (int16)" : "") << ": "
+             << best * 1000 << " ms, " << megapixels / best << " MP/s, deviation from scharr "
+             << orientationDeviation(refAngles, refMagnitudes, angles) << " deg" << endl;
+    }
+}
+
+// the settings --autotune picks for iterate. the engine itself is the
+// user's choice, since the grid engine gives different results.
+class TunedConfig {
+public:
+    int threads;
+    Tiling tiling;
+    double msPerIteration;
+    TunedConfig ();
+};
+
+TunedConfig::TunedConfig ()
+    : threads(maxThreads())
+    , tiling(defaultTiling)
+    , msPerIteration(0.0) {}
+
+// cpu model and logical cpu count, without spaces
+string machineFingerprint ()
+{
+    string model = "unknown";
+    ifstream cpuinfo("/proc/cpuinfo");
+    string line;
+    while (getline(cpuinfo, line)) {
+        if (line.compare(0, 10, "model name") == 0 && line.find(':') != string::npos) {
+            model = line.substr(line.find(':') + 1);
+            model = model.substr(min(model.size(), model.find_first_not_of(" \t")));
+            break;
+        }
+    }
+    replace(model.begin(), model.end(), ' ', '_');
+    return model + "_x" + to_string(thread::hardware_concurrency());
+}
+
+// engine, kernel size, pixel count rounded down to a power of two, and
+// pixel type: images in one bucket share their best configuration
+string tuneBucket (const Options& options, const Mat& coloredImage)
+{
+    int log2Pixels = 0;
+    while ((size_t(2) << log2Pixels) <= coloredImage.total()) {
+        ++log2Pixels;
+    }
+    stringstream ss;
+    ss << options.engine << "_k" << options.filterParams.kernelSize
+       << "_2^" << log2Pixels << "px_type" << coloredImage.type();
+    return ss.str();
+}
+
+string tuneCachePath (const Options& options)
+{
+    if (!options.tuneCache.empty()) {
+        return options.tuneCache;
+    }
+    const char* home = getenv("HOME");
+    return string(home ? home : ".") + "/.orient_tune";
+}
+
+// the cache has one line per tuning run,
+//   fingerprint bucket threads tileRows tileCols ms/iter
+// and is only ever appended to, so the last line for a key wins
+bool loadTuning (const string& cacheName, const string& fingerprint, const string& bucket,
+                 TunedConfig& config)
+{
+    ifstream in(cacheName.c_str());
+    string line;
+    bool found = false;
+    while (getline(in, line)) {
+        stringstream ss(line);
+        string lineFingerprint, lineBucket;
+        TunedConfig candidate;
+        if (ss >> lineFingerprint >> lineBucket >> candidate.threads >> candidate.tiling.rows
+               >> candidate.tiling.cols >> candidate.msPerIteration
+            && lineFingerprint == fingerprint && lineBucket == bucket
+            && candidate.threads > 0 && candidate.tiling.rows > 0 && candidate.tiling.cols >= 0) {
+            config = candidate;
+            found = true;
+        }
+    }
+    return found;
+}
+
+void storeTuning (const string& cacheName, const string& fingerprint, const string& bucket,
+                  const TunedConfig& config)
+{
+    ofstream out(cacheName.c_str(), ios::app);
+    out << fingerprint << " " << bucket << " " << config.threads << " " << config.tiling.rows << " "
+        << config.tiling.cols << " " << config.msPerIteration << endl;
+    if (!out) {
+        cout << "cannot write " << cacheName << endl;
+    }
+}
+
+// best of three iterations, in ms, with the given threads and tiling
+double timeTrial (const Options& options, const Mat& coloredImage, bool rgbOrder,
+                  const Mat& angles, const Mat& magnitudes, int threads, const Tiling& tiling)
+{
+    setThreads(threads);
+    Mat curAngles = angles.clone(), curMagnitudes = magnitudes.clone();
+    Mat nextAngles = angles.clone(), nextMagnitudes = magnitudes.clone();
+    BilateralGrid* grid = 0;
+    if (options.engine == "grid") {
+        grid = new BilateralGrid(coloredImage, options.filterParams, rgbOrder);
+    }
+    double best = 1e30;
+    for (int run = 0; run < 3; ++run) {
+        int64 start = getTickCount();
+        if (grid) {
+            iterateGrid(*grid, curAngles, curMagnitudes, nextAngles, nextMagnitudes);
+        } else {
+            iterate(options.filterParams, curAngles, curMagnitudes, nextAngles, nextMagnitudes, coloredImage, tiling);
+        }
+        best = min(best, (getTickCount() - start) / getTickFrequency());
+    }
+    delete grid;
+    return best * 1000;
+}
+
+// short timed trials on a centered crop of at most 512x512: first the
+// thread count with the default tiling, then tile shapes at the best count
+// (the grid engine has no tiles). leaves the thread count at the winner's.
+TunedConfig autotune (const Options& options, const Mat& coloredImage, bool rgbOrder,
+                      const Mat& angles, const Mat& magnitudes)
+{
+    const int cropRows = min(512, angles.rows);
+    const int cropCols = min(512, angles.cols);
+    const Rect area((angles.cols - cropCols) / 2, (angles.rows - cropRows) / 2, cropCols, cropRows);
+    const Mat crop = coloredImage(area);
+    const Mat cropAngles = angles(area);
+    const Mat cropMagnitudes = magnitudes(area);
+    const int available = maxThreads();
+
+    TunedConfig best;
+    best.threads = available;
+    best.msPerIteration = timeTrial(options, crop, rgbOrder, cropAngles, cropMagnitudes, available, defaultTiling);
+    for (int threads = 1; threads < available; threads *= 2) {
+        const double ms = timeTrial(options, crop, rgbOrder, cropAngles, cropMagnitudes, threads, defaultTiling);
+        cout << "autotune: " << threads << " threads: " << ms << " ms/iter" << endl;
+        if (ms < best.msPerIteration) {
+            best.threads = threads;
+            best.msPerIteration = ms;
+        }
+    }
+    cout << "autotune: " << available << " threads: " << best.msPerIteration << " ms/iter" << endl;
+
+    const int tileRows[] = {4, 16, 64};
+    const int tileCols[] = {0, 64, 256};
+    for (int i = 0; options.engine == "exact" && i < 9; ++i) {
+        const Tiling tiling(tileRows[i / 3], tileCols[i % 3]);
+        const double ms = timeTrial(options, crop, rgbOrder, cropAngles, cropMagnitudes, best.threads, tiling);
+        cout << "autotune: " << tiling.rows << "x" << (tiling.cols ? to_string(tiling.cols) : "row")
+             << " tiles: " << ms << " ms/iter" << endl;
+        if (ms < best.msPerIteration) {
+            best.tiling = tiling;
+            best.msPerIteration = ms;
+        }
+    }
+    setThreads(best.threads);
+    return best;
+}
+
+// whether two Mats of the same shape hold the same bytes
+bool sameBits (const Mat& a, const Mat& b)
+{
+    if (a.rows != b.rows || a.cols != b.cols || a.type() != b.type()) {
+        return false;
+    }
+    const size_t rowBytes = a.cols * a.elemSize();
+    for (int r = 0; r < a.rows; ++r) {
+        if (memcmp(a.ptr(r), b.ptr(r), rowBytes) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// runs gradients, iterations and the map rendering with 1 thread, then with
+// 2, 3, 4, 8, ... up to the OpenMP maximum, and checks that every run gives
+// the same bits as the first. every parallel loop writes disjoint outputs
+// and the image-wide sums go through pairwiseSum, so none of them should
+// depend on the thread count or the schedule.
+int checkDeterminism (const Options& options, const Mat& coloredImage, bool rgbOrder)
+{
+    const int available = maxThreads();
+    vector<int> counts(1, 1);
+    for (int threads = 2; threads < available; threads *= 2) {
+        counts.push_back(threads);
+        if (threads == 2 && available > 3) {
+            counts.push_back(3);
+        }
+    }
+    if (available > 1) {
+        counts.push_back(available);
+    }
+
+    Mat refAngles, refMagnitudes, refMap;
+    bool identical = true;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        setThreads(counts[i]);
+        Mat angles, magnitudes;
+        calcGradients(coloredImage, angles, magnitudes, options.gradient, options.fixedPoint, rgbOrder);
+        Mat nextAngles = angles.clone(), nextMagnitudes = magnitudes.clone();
+        BilateralGrid* grid = 0;
+        if (options.engine == "grid") {
+            grid = new BilateralGrid(coloredImage, options.filterParams, rgbOrder);
+        }
+        for (int it = 0; it < options.iterationTimes; ++it) {
+            if (grid) {
+                iterateGrid(*grid, angles, magnitudes, nextAngles, nextMagnitudes);
+            } else {
+                iterate(options.filterParams, angles, magnitudes, nextAngles, nextMagnitudes, coloredImage);
+            }
+        }
+        delete grid;
+        const Mat map = renderAngleGraph(angles, magnitudes, 0.0f);
+        if (i == 0) {
+            refAngles = angles;
+            refMagnitudes = magnitudes;
+            refMap = map;
+            continue;
+        }
+        const bool same = sameBits(angles, refAngles) && sameBits(magnitudes, refMagnitudes)
+                          && sameBits(map, refMap);
+        cout << counts[i] << " threads: " << (same ? "identical to" : "DIFFERS from") << " 1 thread" << endl;
+        identical = identical && same;
+    }
+    setThreads(available);
+    return identical ? 0 : 1;
+}
+
+// appends snapshot frames to a single video (MJPG or FFV1) from its own
+// thread, so encoding overlaps the next iterations. callers hand over the
+// rendered 8-bit map, which is also the snapshot copy the swapping
+// iteration buffers would otherwise need.
+class SnapshotVideo {
+public:
+    SnapshotVideo (const string& fileName, const string& codec, Size frameSize);
+    ~SnapshotVideo ();
+    bool isOpened () const;
+    void append (const Mat& frame);
+private:
+    VideoWriter writer;
+    BlockingQueue<Mat> frames;
+    thread encoder;
+};
+
+SnapshotVideo::SnapshotVideo (const string& fileName, const string& codec, Size frameSize)
+    : frames(4)
+{
+    const int fourcc = codec == "FFV1" ? CV_FOURCC('F','F','V','1') : CV_FOURCC('M','J','P','G');
+    writer.open(fileName, fourcc, 10.0, frameSize, true);
+    if (writer.isOpened()) {
+        encoder = thread([this] {
+            Mat frame;
+            while (frames.pop(frame)) {
+                writer.write(frame);
+            }
+        });
+    }
+}
+
+SnapshotVideo::~SnapshotVideo ()
+{
+    frames.close();
+    if (encoder.joinable()) {
+        encoder.join();
+    }
+    writer.release();
+}
+
+bool SnapshotVideo::isOpened () const
+{
+    return writer.isOpened();
+}
+
+void SnapshotVideo::append (const Mat& frame)
+{
+    frames.push(frame);
+}
+
+class Frame {
+public:
+    int index;
+    Mat coloredImage;
+    Mat angles;
+    Mat magnitudes;
+};
+
+// blends the previous frame's converged field into the fresh gradients.
+// orientations are averaged as doubled-angle vectors so that -pi/2 and pi/2
+// reinforce instead of cancelling; prevWeight is the share of the old field.
+void warmStart (const Mat& prevAngles, const Mat& prevMagnitudes,
+                Mat& angles, Mat& magnitudes, float prevWeight)
+{
+    const int rows = angles.rows;
+    const int cols = angles.cols;
+    #pragma omp parallel for
+    for (int r = 0; r < rows; ++r) {
+        for (int c = 0; c < cols; ++c) {
+            float pm = prevMagnitudes.at<float>(r,c) * prevWeight;
+            float nm = magnitudes.at<float>(r,c) * (1.0f - prevWeight);
+            float pa = 2 * prevAngles.at<float>(r,c);
+            float na = 2 * angles.at<float>(r,c);
+            float x = pm * cos(pa) + nm * cos(na);
+            float y = pm * sin(pa) + nm * sin(na);
+            float angle = 0.5f * atan2(y, x);
+            if (angle >= PI/2) {
+                angle -= PI;
+            }
+            angles.at<float>(r,c) = angle;
+            magnitudes.at<float>(r,c) = pm + nm;
+        }
+    }
+}
+
+// source is anything VideoCapture opens: a video file or a numbered image
+// pattern such as frame_%04d.png. frames are decoded and their gradients
+// computed on a separate thread while the previous frame iterates.
+int runSequence (const Options& options)
+{
+    const string& source = options.imageName;
+    const GradientOperator gradient = options.gradient;
+    const bool fixedPoint = options.fixedPoint;
+    VideoCapture capture(source);
+    if (!capture.isOpened()) {
+        cout << "cannot open sequence " << source << endl;
+        return 1;
+    }
+    string prefix = source;
+    replace(prefix.begin(), prefix.end(), '%', '_');
+
+    BlockingQueue<Frame> frames(2);
+    const int previewScale = options.previewScale;
+    // the gradients are a fraction of the iterations they overlap, so the
+    // decoder gets a quarter of the team rather than a second full one
+    const int decoderThreads = max(1, maxThreads() / 4);
+    thread decoder([&capture, &frames, gradient, fixedPoint, previewScale, decoderThreads] {
+        TeamSize team(decoderThreads);
+        for (int index = 0; ; ++index) {
+            // a fresh Frame each time: the queued one still shares its buffers
+            Frame frame;
+            frame.index = index;
+            if (!capture.read(frame.coloredImage)) {
+                break;
+            }
+            shrinkForPreview(frame.coloredImage, previewScale);
+            calcGradients(frame.coloredImage, frame.angles, frame.magnitudes, gradient, fixedPoint);
+            frames.push(frame);
+        }
+        frames.close();
+    });
+
+    Mat prevAngles, prevMagnitudes;
+    Frame frame;
+    while (frames.pop(frame)) {
+        Mat& angles = frame.angles;
+        Mat& magnitudes = frame.magnitudes;
+        int iterations = options.iterationTimes;
+        if (!prevAngles.empty() && prevAngles.size() == angles.size()) {
+            warmStart(prevAngles, prevMagnitudes, angles, magnitudes, options.warmBlend);
+            iterations = options.warmIterations;
+        }
+
+        Mat nextAngles = angles.clone();
+        Mat nextMagnitudes = magnitudes.clone();
+        const BilateralWeights weights(options.filterParams, frame.coloredImage.type());
+        for (int i = 0; i < iterations; ++i) {
+            iterate(options.filterParams, weights, angles, magnitudes, nextAngles, nextMagnitudes,
+                    frame.coloredImage);
+        }
+        cout << "frame " << frame.index << ": " << iterations << " iterations" << endl;
+
+        if (frame.index % options.saveStep == 0) {
+            string outName = prefix + "_frame" + to_string(frame.index);
+            saveAngles(options, outName + ".txt", angles);
+            saveMap(options, outName + options.imageExtension, angles, magnitudes);
+        }
+        prevAngles = angles;
+        prevMagnitudes = magnitudes;
+    }
+    decoder.join();
+    return 0;
+}
+
+// frames on stdin and fields on stdout, so orient can sit in a pipe. every
+// record, in either direction, is a 24 byte little-endian header
+//   magic 'ORNT', rows, cols, type    int32 each
+//   payload bytes                     uint64
+// followed by the payload. input type is an OpenCV type (CV_8UC3, CV_16UC3,
+// CV_32FC3 in BGR order, or a single-channel variant) with rows*cols pixels,
+// or -1 for an encoded image (png, jpeg, tiff, ...) for imdecode. each frame
+// is answered by two CV_32FC1 records: the angles, then the magnitudes.
+// pixel and field samples are in the host's byte order, as both ends of a
+// pipe share it. a frame that cannot be processed (another pixel type, a
+// size that does not match the payload, an image that does not decode) is
+// answered by a single record of type streamError, 0 rows and cols, and the
+// message as payload, and the stream goes on. only a bad header or a short
+// read end it. progress messages go to stderr.
+const int streamMagic = 0x544e524f;
+const int streamError = -2;
+
+class StreamHeader {
+public:
+    int magic;
+    int rows;
+    int cols;
+    int type;
+    uint64_t payloadBytes;
+    StreamHeader ();
+    StreamHeader (int rows_, int cols_, int type_, uint64_t payloadBytes_);
+    bool read (FILE* file);
+    void write (FILE* file) const;
+    static const size_t bytes = 24;
+};
+
+StreamHeader::StreamHeader ()
+    : magic(0)
+    , rows(0)
+    , cols(0)
+    , type(0)
+    , payloadBytes(0) {}
+
+StreamHeader::StreamHeader (int rows_, int cols_, int type_, uint64_t payloadBytes_)
+    : magic(streamMagic)
+    , rows(rows_)
+    , cols(cols_)
+    , type(type_)
+    , payloadBytes(payloadBytes_) {}
+
+bool readFully (FILE* file, void* data, size_t bytes)
+{
+    return fread(data, 1, bytes, file) == bytes;
+}
+
+bool StreamHeader::read (FILE* file)
+{
+    uchar raw[bytes];
+    if (!readFully(file, raw, bytes)) {
+        return false;
+    }
+    uint32_t fields[4] = {0, 0, 0, 0};
+    for (int f = 0; f < 4; ++f) {
+        for (int i = 3; i >= 0; --i) {
+            fields[f] = fields[f] << 8 | raw[4 * f + i];
+        }
+    }
+    magic = int(fields[0]);
+    rows = int(fields[1]);
+    cols = int(fields[2]);
+    type = int(fields[3]);
+    payloadBytes = 0;
+    for (int i = 7; i >= 0; --i) {
+        payloadBytes = payloadBytes << 8 | raw[16 + i];
+    }
+    return true;
+}
+
+void StreamHeader::write (FILE* file) const
+{
+    uchar raw[bytes];
+    const uint32_t fields[4] = {uint32_t(magic), uint32_t(rows), uint32_t(cols), uint32_t(type)};
+    for (int f = 0; f < 4; ++f) {
+        for (int i = 0; i < 4; ++i) {
+            raw[4 * f + i] = uchar(fields[f] >> (8 * i));
+        }
+    }
+    for (int i = 0; i < 8; ++i) {
+        raw[16 + i] = uchar(payloadBytes >> (8 * i));
+    }
+    fwrite(raw, bytes, 1, file);
+}
+
+void writeStreamRecord (FILE* file, const Mat& field)
+{
+    Mat continuous = field.isContinuous() ? field : field.clone();
+    const size_t payloadBytes = continuous.total() * continuous.elemSize();
+    StreamHeader(continuous.rows, continuous.cols, continuous.type(), payloadBytes).write(file);
+    fwrite(continuous.data, 1, payloadBytes, file);
+}
+
+void writeStreamError (FILE* file, const string& message)
+{
+    StreamHeader(0, 0, streamError, message.size()).write(file);
+    fwrite(message.data(), 1, message.size(), file);
+}
+
+// the frame in payload, or an empty Mat and the reason in error
+Mat streamFrame (const StreamHeader& header, const vector<uchar>& payload, string& error)
+{
+    Mat coloredImage;
+    if (header.type == -1) {
+        coloredImage = imdecode(payload, IMREAD_COLOR | IMREAD_ANYDEPTH);
+        if (coloredImage.empty()) {
+            error = "cannot decode the image";
+        } else if (!readablePixelType(coloredImage.type())) {
+            error = "the image decodes to an unsupported pixel type";
+            coloredImage.release();
+        }
+        return coloredImage;
+    }
+    if (header.rows < 1 || header.cols < 1 || !readablePixelType(header.type)) {
+        error = "raw frames need positive rows and cols and an 8U, 16U or 32F type of 1 or 3 channels";
+        return coloredImage;
+    }
+    if (uint64_t(header.rows) * header.cols * CV_ELEM_SIZE(header.type) != header.payloadBytes) {
+        error = "payload size does not match rows, cols and type";
+        return coloredImage;
+    }
+    return Mat(header.rows, header.cols, header.type, const_cast<uchar*>(payload.data()));
+}
+
+int runStream (const Options& options)
+{
+    streambuf* stdoutBuffer = cout.rdbuf(cerr.rdbuf());
+    CancelToken& cancel = signalCancelToken;
+    signal(SIGUSR1, cancelOnSignal);
+    int frameIndex = 0;
+    StreamHeader header;
+    while (header.read(stdin)) {
+        if (header.magic != streamMagic || header.payloadBytes > SIZE_MAX) {
+            cout << "stream: bad header on frame " << frameIndex << endl;
+            cout.rdbuf(stdoutBuffer);
+            return 1;
+        }
+        vector<uchar> payload;
+        try {
+            payload.resize(size_t(header.payloadBytes));
+        } catch (const exception&) {
+            cout << "stream: no memory for the " << header.payloadBytes << " byte payload of frame " << frameIndex
+                 << endl;
+            cout.rdbuf(stdoutBuffer);
+            return 1;
+        }
+        if (!readFully(stdin, payload.data(), payload.size())) {
+            cout << "stream: truncated frame " << frameIndex << endl;
+            cout.rdbuf(stdoutBuffer);
+            return 1;
+        }
+
+        // a frame that fails is answered with its error and skipped
+        string error;
+        int completed = 0;
+        Mat angles, magnitudes;
+        try {
+            const Mat coloredImage = streamFrame(header, payload, error);
+            if (!coloredImage.empty()) {
+                // each frame gets the --budget from its arrival, and SIGUSR1
+                // cuts the current one short: it is answered with the field
+                // so far
+                CancelRun run(cancel, options.budgetSeconds);
+                calcGradients(coloredImage, angles, magnitudes, options.gradient, options.fixedPoint);
+                Mat nextAngles = angles.clone();
+                Mat nextMagnitudes = magnitudes.clone();
+                if (options.engine == "grid") {
+                    BilateralGrid grid(coloredImage, options.filterParams);
+                    for (; completed < options.iterationTimes && !cancel.stopped(); ++completed) {
+                        iterateGrid(grid, angles, magnitudes, nextAngles, nextMagnitudes);
+                    }
+                } else {
+                    const BilateralWeights weights(options.filterParams, coloredImage.type());
+                    while (completed < options.iterationTimes
+                           && iterate(options.filterParams, weights, angles, magnitudes, nextAngles, nextMagnitudes,
+                                      coloredImage, defaultTiling, &cancel)) {
+                        ++completed;
+                    }
+                }
+            }
+        } catch (const exception& e) {
+            error = e.what();
+        }
+        if (!error.empty()) {
+            cout << "stream: frame " << frameIndex++ << ": " << error << endl;
+            writeStreamError(stdout, error);
+            fflush(stdout);
+            continue;
+        }
+        writeStreamRecord(stdout, angles);
+        writeStreamRecord(stdout, magnitudes);
+        fflush(stdout);
+        cout << "frame " << frameIndex++ << " done";
+        if (completed < options.iterationTimes) {
+            cout << " after " << completed << " of " << options.iterationTimes << " iterations";
+        }
+        cout << endl;
+    }
+    cout.rdbuf(stdoutBuffer);
+    return 0;
+}
+
+// a binary PGM/PPM (P5/P6) or headerless raw file mapped read-only and
+// wrapped in a Mat header without copying, so only the pages the gradient
+// bands and iterations actually touch are ever read. PPM pixels stay in RGB
+// order (rgbOrder). 16-bit PNM samples are big-endian and get one swapped
+// copy on little-endian hosts.
+class MappedImage {
+public:
+    Mat image;
+    bool rgbOrder;
+    MappedImage ();
+    ~MappedImage ();
+    bool open (const string& fileName, const string& rawSpec);
+private:
+    void* base;
+    size_t length;
+    MappedImage (const MappedImage&);
+    MappedImage& operator= (const MappedImage&);
+};
+
+MappedImage::MappedImage ()
+    : rgbOrder(false)
+    , base(MAP_FAILED)
+    , length(0) {}
+
+MappedImage::~MappedImage ()
+{
+    image.release();
+    if (base != MAP_FAILED) {
+        munmap(base, length);
+    }
+}
+
+bool isPnmFile (const string& fileName)
+{
+    const size_t dot = fileName.rfind('.');
+    if (dot == string::npos) {
+        return false;
+    }
+    string ext = fileName.substr(dot + 1);
+    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == "pgm" || ext == "ppm" || ext == "pnm";
+}
+
+// rows,cols,type[,offset] with type one of 8UC1 8UC3 16UC1 16UC3 32FC1 32FC3
+bool parseRawSpec (const string& spec, int& rows, int& cols, int& type, size_t& offset)
+{
+    stringstream ss(spec);
+    string rowsText, colsText, typeText, offsetText;
+    if (!getline(ss, rowsText, ',') || !getline(ss, colsText, ',') || !getline(ss, typeText, ',')) {
+        return false;
+    }
+    offset = getline(ss, offsetText, ',') ? strtoull(offsetText.c_str(), 0, 10) : 0;
+    rows = atoi(rowsText.c_str());
+    cols = atoi(colsText.c_str());
+    const char* const names[] = {"8UC1", "8UC3", "16UC1", "16UC3", "32FC1", "32FC3"};
+    const int types[] = {CV_8UC1, CV_8UC3, CV_16UC1, CV_16UC3, CV_32FC1, CV_32FC3};
+    for (int i = 0; i < 6; ++i) {
+        if (typeText == names[i]) {
+            type = types[i];
+            return rows > 0 && cols > 0;
+        }
+    }
+    return false;
+}
+
+bool MappedImage::open (const string& fileName, const string& rawSpec)
+{
+    int fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cout << "cannot open " << fileName << endl;
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+    length = info.st_size;
+    base = mmap(0, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        cout << "cannot map " << fileName << endl;
+        return false;
+    }
+    const char* bytes = static_cast<const char*>(base);
+
+    int rows = 0, cols = 0, type = CV_8UC1;
+    size_t offset = 0;
+    bool bigEndian = false;
+    if (!rawSpec.empty()) {
+        if (!parseRawSpec(rawSpec, rows, cols, type, offset)) {
+            cout << "bad --raw spec " << rawSpec << endl;
+            return false;
+        }
+    } else {
+        // "P5"/"P6", then width, height and maxval separated by whitespace
+        // and # comments, then exactly one whitespace byte before the data
+        if (length < 2 || bytes[0] != 'P' || (bytes[1] != '5' && bytes[1] != '6')) {
+            return false;
+        }
+        const int channels = bytes[1] == '6' ? 3 : 1;
+        long fields[3];
+        size_t pos = 2;
+        for (int f = 0; f < 3; ++f) {
+            while (pos < length && (isspace((unsigned char)bytes[pos]) || bytes[pos] == '#')) {
+                if (bytes[pos] == '#') {
+                    while (pos < length && bytes[pos] != '\n') {
+                        ++pos;
+                    }
+                } else {
+                    ++pos;
+                }
+            }
+            const size_t first = pos;
+            fields[f] = 0;
+            while (pos < length && isdigit((unsigned char)bytes[pos]) && fields[f] <= INT_MAX) {
+                fields[f] = fields[f] * 10 + (bytes[pos++] - '0');
+            }
+            if (pos == first || fields[f] > INT_MAX) {
+                cout << fileName << " has a malformed PNM header" << endl;
+                return false;
+            }
+        }
+        if (fields[0] < 1 || fields[1] < 1 || fields[2] < 1 || fields[2] > 65535
+            || pos >= length || !isspace((unsigned char)bytes[pos])) {
+            cout << fileName << " has a malformed PNM header" << endl;
+            return false;
+        }
+        cols = fields[0];
+        rows = fields[1];
+        const bool wide = fields[2] > 255;
+        type = CV_MAKETYPE(wide ? CV_16U : CV_8U, channels);
+        offset = pos + 1;
+        bigEndian = wide;
+        rgbOrder = channels == 3;
+    }
+
+    // rows and cols are positive ints, so their product cannot overflow
+    const size_t pixelBytes = CV_ELEM_SIZE(type);
+    if (offset > length || size_t(rows) * cols > (length - offset) / pixelBytes) {
+        cout << fileName << " is shorter than its " << rows << "x" << cols << " header says" << endl;
+        return false;
+    }
+    image = Mat(rows, cols, type, const_cast<char*>(bytes) + offset);
+    const unsigned short probe = 1;
+    if (bigEndian && *reinterpret_cast<const unsigned char*>(&probe) == 1) {
+        Mat swapped(rows, cols, type);
+        const unsigned char* src = reinterpret_cast<const unsigned char*>(bytes) + offset;
+        unsigned short* dst = reinterpret_cast<unsigned short*>(swapped.data);
+        for (size_t i = 0; i < size_t(rows) * cols * CV_MAT_CN(type); ++i) {
+            dst[i] = (src[2*i] << 8) | src[2*i+1];
+        }
+        image = swapped;
+    }
+    return true;
+}
+
+// rows [first, first+count) of a tall image held in a fixed buffer. rows
+// are appended at the bottom and dropped from the top; the buffer is
+// compacted only when an append would run off its end.
+class RowWindow {
+public:
+    RowWindow (int capacity, int cols, int type);
+    int end () const;
+    Mat append (int rows);
+    Mat view (int from, int to) const;
+    void dropBefore (int row);
+private:
+    Mat buffer;
+    int first;
+    int offset;
+    int count;
+};
+
+RowWindow::RowWindow (int capacity, int cols, int type)
+    : buffer(capacity, cols, type)
+    , first(0)
+    , offset(0)
+    , count(0) {}
+
+int RowWindow::end () const
+{
+    return first + count;
+}
+
+// returns the header of the next rows, for the caller to fill
+Mat RowWindow::append (int rows)
+{
+    if (offset + count + rows > buffer.rows) {
+        memmove(buffer.ptr(0), buffer.ptr(offset), count * buffer.step[0]);
+        offset = 0;
+    }
+    assert(count + rows <= buffer.rows);
+    Mat rowsToFill = buffer.rowRange(offset + count, offset + count + rows);
+    count += rows;
+    return rowsToFill;
+}
+
+Mat RowWindow::view (int from, int to) const
+{
+    assert(from >= first && to <= end());
+    return buffer.rowRange(offset + from - first, offset + to - first);
+}
+
+void RowWindow::dropBefore (int row)
+{
+    const int dropped = min(count, row - first);
+    if (dropped > 0) {
+        first += dropped;
+        offset += dropped;
+        count -= dropped;
+    }
+}
+
+// decodes an image top to bottom, a few rows at a time
+class StripReader {
+public:
+    int rows;
+    int cols;
+    int type;
+    bool rgbOrder;
+    StripReader ();
+    virtual ~StripReader () {}
+    // fills all of dst (dst.rows rows of cols pixels of type) with the next rows
+    virtual bool readRows (Mat& dst) = 0;
+};
+
+StripReader::StripReader ()
+    : rows(0)
+    , cols(0)
+    , type(CV_8UC3)
+    , rgbOrder(false) {}
+
+// for formats without a strip decoder: the image is already whole in memory
+// (decoded, or mapped with MappedImage, which is still out-of-core)
+class MatStripReader : public StripReader {
+public:
+    MatStripReader (const Mat& image_, bool rgbOrder_);
+    bool readRows (Mat& dst);
+private:
+    Mat image;
+    int next;
+};
+
+MatStripReader::MatStripReader (const Mat& image_, bool rgbOrder_)
+    : image(image_)
+    , next(0)
+{
+    rows = image.rows;
+    cols = image.cols;
+    type = image.type();
+    rgbOrder = rgbOrder_;
+}
+
+bool MatStripReader::readRows (Mat& dst)
+{
+    image.rowRange(next, next + dst.rows).copyTo(dst);
+    next += dst.rows;
+    return true;
+}
+
+// copies one decoded row of samplesPerPixel interleaved samples into dst,
+// which keeps the first 1 or 3 of them (alpha and extra samples are dropped)
+void copyInterleavedRow (const uchar* src, int samplesPerPixel, Mat& dst, int r)
+{
+    const int channels = dst.channels();
+    const size_t sampleSize = dst.elemSize1();
+    uchar* out = dst.ptr(r);
+    for (int c = 0; c < dst.cols; ++c) {
+        memcpy(out + c * channels * sampleSize, src + c * samplesPerPixel * sampleSize, channels * sampleSize);
+    }
+}
+
+#ifdef ORIENT_HAVE_TIFF
+// striped TIFFs are read scanline by scanline, which decodes one strip at a
+// time; tiled TIFFs one row of tiles at a time. 8/16-bit integer and 32-bit
+// float samples, 1 channel or RGB(A), contiguous planar configuration.
+class TiffStripReader : public StripReader {
+public:
+    TiffStripReader ();
+    ~TiffStripReader ();
+    bool open (const string& fileName);
+    bool readRows (Mat& dst);
+private:
+    TIFF* tiff;
+    int samplesPerPixel;
+    uint32_t tileWidth;
+    uint32_t tileHeight;
+    vector<uchar> scanline;
+    Mat tileRow;
+    int tileRowFirst;
+    int next;
+};
+
+TiffStripReader::TiffStripReader ()
+    : tiff(0)
+    , samplesPerPixel(1)
+    , tileWidth(0)
+    , tileHeight(0)
+    , tileRowFirst(-1)
+    , next(0) {}
+
+TiffStripReader::~TiffStripReader ()
+{
+    if (tiff) {
+        TIFFClose(tiff);
+    }
+}
+
+bool TiffStripReader::open (const string& fileName)
+{
+    tiff = TIFFOpen(fileName.c_str(), "r");
+    if (!tiff) {
+        return false;
+    }
+    uint32_t width = 0, height = 0;
+    uint16_t bitsPerSample = 8, sampleFormat = SAMPLEFORMAT_UINT, planar = PLANARCONFIG_CONTIG, spp = 1;
+    TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height);
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_BITSPERSAMPLE, &bitsPerSample);
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_SAMPLESPERPIXEL, &spp);
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_SAMPLEFORMAT, &sampleFormat);
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_PLANARCONFIG, &planar);
+
+    int depth = -1;
+    if (bitsPerSample == 8 && sampleFormat == SAMPLEFORMAT_UINT) {
+        depth = CV_8U;
+    } else if (bitsPerSample == 16 && sampleFormat == SAMPLEFORMAT_UINT) {
+        depth = CV_16U;
+    } else if (bitsPerSample == 32 && sampleFormat == SAMPLEFORMAT_IEEEFP) {
+        depth = CV_32F;
+    }
+    if (depth < 0 || planar != PLANARCONFIG_CONTIG || spp == 2) {
+        return false;
+    }
+    rows = height;
+    cols = width;
+    samplesPerPixel = spp;
+    type = CV_MAKETYPE(depth, spp >= 3 ? 3 : 1);
+    rgbOrder = spp >= 3;
+    if (TIFFIsTiled(tiff)) {
+        TIFFGetField(tiff, TIFFTAG_TILEWIDTH, &tileWidth);
+        TIFFGetField(tiff, TIFFTAG_TILELENGTH, &tileHeight);
+        scanline.resize(TIFFTileSize(tiff));
+        tileRow.create(tileHeight, cols, type);
+    } else {
+        scanline.resize(TIFFScanlineSize(tiff));
+    }
+    return true;
+}
+
+bool TiffStripReader::readRows (Mat& dst)
+{
+    const size_t sampleSize = CV_ELEM_SIZE1(type);
+    for (int i = 0; i < dst.rows; ++i, ++next) {
+        if (!tileWidth) {
+            if (TIFFReadScanline(tiff, &scanline[0], next, 0) < 0) {
+                return false;
+            }
+            copyInterleavedRow(&scanline[0], samplesPerPixel, dst, i);
+            continue;
+        }
+        const int first = next / tileHeight * tileHeight;
+        if (first != tileRowFirst) {
+            // decode the whole row of tiles containing this image row
+            for (int x = 0; x < cols; x += tileWidth) {
+                if (TIFFReadTile(tiff, &scanline[0], x, first, 0, 0) < 0) {
+                    return false;
+                }
+                const int width = min<int>(tileWidth, cols - x);
+                for (int ty = 0; ty < int(tileHeight) && first + ty < rows; ++ty) {
+                    const uchar* src = &scanline[ty * tileWidth * samplesPerPixel * sampleSize];
+                    Mat part = tileRow.row(ty).colRange(x, x + width);
+                    copyInterleavedRow(src, samplesPerPixel, part, 0);
+                }
+            }
+            tileRowFirst = first;
+        }
+        tileRow.row(next - first).copyTo(dst.row(i));
+    }
+    return true;
+}
+#endif
+
+#ifdef ORIENT_HAVE_JPEG
+struct JpegErrorManager {
+    jpeg_error_mgr manager;
+    jmp_buf escape;
+};
+
+void jpegErrorExit (j_common_ptr info)
+{
+    (*info->err->output_message)(info);
+    longjmp(reinterpret_cast<JpegErrorManager*>(info->err)->escape, 1);
+}
+
+// libjpeg scanline decoding: baseline JPEGs hold only the current MCU row.
+// progressive JPEGs are decoded by libjpeg through its whole-image
+// coefficient buffer, so for them only the pixel side is strip-sized.
+class JpegStripReader : public StripReader {
+public:
+    JpegStripReader ();
+    ~JpegStripReader ();
+    bool open (const string& fileName);
+    bool readRows (Mat& dst);
+private:
+    jpeg_decompress_struct info;
+    JpegErrorManager errors;
+    FILE* file;
+    bool started;
+};
+
+JpegStripReader::JpegStripReader ()
+    : file(0)
+    , started(false)
+{
+    info.err = jpeg_std_error(&errors.manager);
+    errors.manager.error_exit = jpegErrorExit;
+    jpeg_create_decompress(&info);
+}
+
+JpegStripReader::~JpegStripReader ()
+{
+    jpeg_destroy_decompress(&info);
+    if (file) {
+        fclose(file);
+    }
+}
+
+bool JpegStripReader::open (const string& fileName)
+{
+    file = fopen(fileName.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    if (setjmp(errors.escape)) {
+        return false;
+    }
+    jpeg_stdio_src(&info, file);
+    jpeg_read_header(&info, TRUE);
+    info.out_color_space = info.num_components == 1 ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_start_decompress(&info);
+    started = true;
+    rows = info.output_height;
+    cols = info.output_width;
+    type = info.output_components == 1 ? CV_8UC1 : CV_8UC3;
+    rgbOrder = info.output_components == 3;
+    return true;
+}
+
+bool JpegStripReader::readRows (Mat& dst)
+{
+    if (setjmp(errors.escape)) {
+        return false;
+    }
+    for (int i = 0; i < dst.rows; ++i) {
+        JSAMPROW row = dst.ptr(i);
+        if (jpeg_read_scanlines(&info, &row, 1) != 1) {
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+// picks a strip decoder by extension and falls back to a whole-image
+// decode (or a mapping, for PNM and raw files) for everything else
+StripReader* openStripReader (const Options& options, MappedImage& mapped)
+{
+    const string& fileName = options.imageName;
+    string ext = fileName.substr(fileName.rfind('.') + 1);
+    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+#ifdef ORIENT_HAVE_TIFF
+    if (ext == "tif" || ext == "tiff") {
+        TiffStripReader* reader = new TiffStripReader();
+        if (reader->open(fileName)) {
+            return reader;
+        }
+        delete reader;
+    }
+#endif
+#ifdef ORIENT_HAVE_JPEG
+    if (ext == "jpg" || ext == "jpeg") {
+        JpegStripReader* reader = new JpegStripReader();
+        if (reader->open(fileName)) {
+            return reader;
+        }
+        delete reader;
+    }
+#endif
+    if ((!options.rawSpec.empty() || isPnmFile(fileName)) && mapped.open(fileName, options.rawSpec)) {
+        return new MatStripReader(mapped.image, mapped.rgbOrder);
+    }
+    cout << "no strip decoder for " << fileName << ", decoding it whole" << endl;
+    Mat image = imread(fileName, IMREAD_COLOR | IMREAD_ANYDEPTH);
+    if (image.empty()) {
+        return 0;
+    }
+    return new MatStripReader(image, false);
+}
+
+// says when an asynchronous write fails; runs on the I/O thread
+function<void(int)> reportWrite (const string& fileName)
+{
+    return [fileName] (int status) {
+        if (status != 0) {
+            cout << "cannot write " << fileName << ": " << strerror(status) << endl;
+        }
+    };
+}
+
+// a snapshot's field, into the pack with --pack, handed to the I/O threads
+// with --async-io and to its own file otherwise
+void saveAngles (const Options& options, const string& fileName, const Mat& angles)
+{
+    if (options.pack) {
+        if (!options.pack->addAngles(fileName, angles)) {
+            cout << "cannot pack " << fileName << endl;
+        }
+    } else if (options.io) {
+        ostringstream text;
+        writeAngles(text, angles);
+        const string& formatted = text.str();
+        vector<uchar> bytes(formatted.begin(), formatted.end());
+        options.io->write(fileName, bytes, options.directIo, reportWrite(fileName));
+    } else {
+        saveAngleToFile(fileName, angles);
+    }
+}
+
+// an image already rendered (a map, the sweep's montage), like saveAngles
+void saveRendered (const Options& options, const string& imageName, const Mat& graph)
+{
+    if (options.pack) {
+        cout << "packing " << imageName << endl;
+        if (!options.pack->addImage(imageName, graph)) {
+            cout << "cannot pack " << imageName << endl;
+        }
+        return;
+    }
+    cout << "saving " << imageName << endl;
+    vector<uchar> bytes;
+    if (!options.io || !encodeImage(imageName, graph, bytes)) {
+        writeImage(imageName, graph);
+        return;
+    }
+    options.io->write(imageName, bytes, options.directIo, reportWrite(imageName));
+}
+
+// a snapshot's orientation map, like saveAngles
+void saveMap (const Options& options, const string& imageName, const Mat& angles, const Mat& magnitudes)
+{
+    saveRendered(options, imageName, renderAngleGraph(angles, magnitudes, 0.0f));
+}
+
+// out-of-core run: the input is decoded a strip at a time and pushed
+// through the gradient stage and one stage per iteration, each lagging the
+// previous one by the rows its kernel reaches. only a window of input rows
+// (radius + (iterations+1) * kernelSize/2 plus a few strips) and a few rows
+// per iteration are ever held; the final field is the only full-size data.
+// intermediate snapshots are streamed to their .txt files as rows complete.
+int runStrips (const Options& options)
+{
+    MappedImage mapped;
+    StripReader* reader = openStripReader(options, mapped);
+    if (!reader) {
+        cout << "cannot read " << options.imageName << endl;
+        return 1;
+    }
+    if (options.gradient == GRADIENT_TENSOR) {
+        cout << "the structure tensor needs the whole image, use another --gradient with --strips" << endl;
+        delete reader;
+        return 1;
+    }
+    const int rows = reader->rows;
+    const int cols = reader->cols;
+    const int iterations = options.iterationTimes;
+    const FilterParams& params = options.filterParams;
+    const int h = params.kernelSize / 2;
+    const GradientKernel& kernel = gradientKernel(options.gradient);
+    const int R = kernel.radius;
+    const int stripRows = 8;
+    const bool fixedPoint = options.fixedPoint && CV_MAT_DEPTH(reader->type) == CV_8U
+                            && fitsFixedPoint(options.gradient);
+    const BilateralWeights weights(params, reader->type);
+
+    RowWindow color(R + (iterations+1) * h + 3 * stripRows + 2, cols, reader->type);
+    // stage s holds the field after s iterations; stage 0 is the gradients
+    vector<RowWindow*> stageAngles, stageMagnitudes;
+    for (int s = 0; s < iterations; ++s) {
+        stageAngles.push_back(new RowWindow(2*h + 3 * stripRows + 2, cols, CV_32F));
+        stageMagnitudes.push_back(new RowWindow(2*h + 3 * stripRows + 2, cols, CV_32F));
+    }
+    Mat angles(rows, cols, CV_32F), magnitudes(rows, cols, CV_32F);
+    vector<ofstream*> snapshots(iterations, (ofstream*)0);
+    for (int s = 1; s < iterations; ++s) {
+        if (s % options.saveStep == 0) {
+            snapshots[s] = new ofstream(options.imageName + "_" + to_string(s) + "_iter.txt");
+            *snapshots[s] << rows << " " << cols << endl;
+        }
+    }
+
+    vector<int> done(iterations + 1, 0);
+    vector<float> buffer;
+    vector<short> fixedBuffer;
+    vector<int> squared;
+    int read = 0;
+    bool ok = true;
+    while (ok && done[iterations] < rows) {
+        if (read < rows) {
+            Mat strip = color.append(min(stripRows, rows - read));
+            ok = reader->readRows(strip);
+            read += strip.rows;
+        }
+
+        // gradients for every row whose halo has been read. no stage advances
+        // more than a strip per pass, which bounds the rows each window holds
+        const int gradientTarget = min(done[0] + stripRows, read == rows ? rows : max(0, read - R));
+        if (gradientTarget > done[0]) {
+            const int v0 = max(0, done[0] - R);
+            const int v1 = min(rows, gradientTarget + R);
+            Mat input = color.view(v0, v1);
+            Mat bandAngles(v1 - v0, cols, CV_32F), bandMagnitudes(v1 - v0, cols, CV_32F);
+            if (fixedPoint) {
+                calcGradientBandFixed(input, kernel, done[0] - v0, gradientTarget - v0,
+                                      bandAngles, bandMagnitudes, fixedBuffer, squared, reader->rgbOrder);
+            } else {
+                calcGradientBand(input, kernel, done[0] - v0, gradientTarget - v0,
+                                 bandAngles, bandMagnitudes, buffer, false, reader->rgbOrder);
+            }
+            const Range produced(done[0] - v0, gradientTarget - v0);
+            if (iterations == 0) {
+                bandAngles.rowRange(produced).copyTo(angles.rowRange(done[0], gradientTarget));
+                bandMagnitudes.rowRange(produced).copyTo(magnitudes.rowRange(done[0], gradientTarget));
+            } else {
+                Mat a = stageAngles[0]->append(produced.end - produced.start);
+                Mat m = stageMagnitudes[0]->append(produced.end - produced.start);
+                bandAngles.rowRange(produced).copyTo(a);
+                bandMagnitudes.rowRange(produced).copyTo(m);
+            }
+            done[0] = gradientTarget;
+        }
+
+        // each iteration advances as far as the previous one allows
+        for (int s = 1; s <= iterations; ++s) {
+            const int target = min(done[s] + stripRows, done[s-1] == rows ? rows : max(0, done[s-1] - h));
+            if (target <= done[s]) {
+                continue;
+            }
+            const int r0 = done[s];
+            const int v0 = max(0, r0 - h);
+            const int v1 = min(rows, target + h);
+            const Mat prevAngles = stageAngles[s-1]->view(v0, v1);
+            const Mat prevMagnitudes = stageMagnitudes[s-1]->view(v0, v1);
+            const Mat window = color.view(v0, v1);
+            Mat nextAngles(v1 - v0, cols, CV_32F), nextMagnitudes(v1 - v0, cols, CV_32F);
+            #pragma omp parallel for schedule(dynamic)
+            for (int r = r0; r < target; ++r) {
+                for (int c = 0; c < cols; ++c) {
+                    updateCell(r - v0, c, params, weights, nextAngles, nextMagnitudes,
+                               prevAngles, prevMagnitudes, window);
+                }
+            }
+
+            const Range produced(r0 - v0, target - v0);
+            if (s == iterations) {
+                nextAngles.rowRange(produced).copyTo(angles.rowRange(r0, target));
+                nextMagnitudes.rowRange(produced).copyTo(magnitudes.rowRange(r0, target));
+            } else {
+                Mat a = stageAngles[s]->append(target - r0);
+                Mat m = stageMagnitudes[s]->append(target - r0);
+                nextAngles.rowRange(produced).copyTo(a);
+                nextMagnitudes.rowRange(produced).copyTo(m);
+                if (snapshots[s]) {
+                    appendAngleRows(*snapshots[s], nextAngles.rowRange(produced));
+                }
+            }
+            done[s] = target;
+            stageAngles[s-1]->dropBefore(done[s] - h);
+            stageMagnitudes[s-1]->dropBefore(done[s] - h);
+        }
+        color.dropBefore(min(done[0] - R, done[iterations] - h));
+    }
+
+    for (int s = 0; s < iterations; ++s) {
+        delete stageAngles[s];
+        delete stageMagnitudes[s];
+        delete snapshots[s];
+    }
+    delete reader;
+    if (!ok) {
+        cout << "decoding " << options.imageName << " failed" << endl;
+        return 1;
+    }
+
+    string outName = options.imageName + "_" + to_string(iterations) + "_iter";
+    saveAngleToFile(outName + ".txt", angles);
+    if (options.dzi) {
+        saveAnglePyramid(outName, angles, magnitudes, 0.0f);
+    } else {
+        saveAngleGraph(outName + options.imageExtension, angles, magnitudes, 0.0f);
+    }
+    return 0;
+}
+
+// writes the snapshot taken after the given iteration: the .txt field and
+// its map every saveStep iterations, or with --video a frame every saveStep
+// iterations and the .txt field after the last one only
+// stoppedEarly marks the field a --budget or cancel left after iteration,
+// which is saved like the last one (its video frame is already in)
+void saveIteration (const Options& options, int iteration, const Mat& angles,
+                    const Mat& magnitudes, SnapshotVideo* video, bool stoppedEarly)
+{
+    string outName = options.imageName + "_" + to_string(iteration) + "_iter";
+    if (video) {
+        if (iteration % options.saveStep == 0 && !stoppedEarly) {
+            video->append(renderAngleGraph(angles, magnitudes, 0.0f));
+        }
+        if (iteration == options.iterationTimes || stoppedEarly) {
+            saveAngles(options, outName + ".txt", angles);
+        }
+    } else if (iteration % options.saveStep == 0 || stoppedEarly) {
+        saveAngles(options, outName + ".txt", angles);
+        if (options.dzi) {
+            saveAnglePyramid(outName, angles, magnitudes, 0.0f);
+        } else {
+            saveMap(options, outName + options.imageExtension, angles, magnitudes);
+        }
+    }
+}
+
+// the --synthetic benchmark input: rings whose frequency rises outward,
+// so every orientation and a range of edge spacings occur, over a color
+// ramp, plus fixed-seed noise. the same size always gives the same image.
+Mat syntheticImage (int rows, int cols)
+{
+    Mat image(rows, cols, CV_8UC3);
+    RNG rng(12345);
+    const float scale = 4.0f * max(rows, cols);
+    for (int r = 0; r < rows; ++r) {
+        for (int c = 0; c < cols; ++c) {
+            const float dx = c - 0.5f * cols;
+            const float dy = r - 0.5f * rows;
+            const float ring = 127.5f * (1.0f + sin((dx*dx + dy*dy) / scale));
+            image.at<Vec3b>(r,c) = Vec3b(saturate_cast<uchar>(ring + rng.gaussian(8.0)),
+                                         saturate_cast<uchar>(255.0f * c / cols),
+                                         saturate_cast<uchar>(255.0f - ring));
+        }
+    }
+    return image;
+}
+
+// the default mode: one image, its gradients, then the iterations with a
+// snapshot every saveStep
+int runImage (const Options& options)
+{
+    const string& imageName = options.imageName;
+    const int iterationTimes = options.iterationTimes;
+    const int64 start = getTickCount();
+
+    MappedImage mapped;
+    Mat coloredImage;
+    if (options.syntheticRows > 0) {
+        coloredImage = syntheticImage(options.syntheticRows, options.syntheticCols);
+    } else if (!options.prefetched.empty()) {
+        coloredImage = imdecode(options.prefetched, previewReadFlags(options.previewScale));
+    } else if (!options.rawSpec.empty() || isPnmFile(imageName)) {
+        if (mapped.open(imageName, options.rawSpec)) {
+            coloredImage = mapped.image;
+            shrinkForPreview(coloredImage, options.previewScale);
+        } else if (!options.rawSpec.empty()) {
+            return 1;
+        }
+    }
+    if (coloredImage.empty()) {
+        // keeps 16-bit and float inputs at their native depth
+        coloredImage = imread(imageName, previewReadFlags(options.previewScale));
+    }
+    if (coloredImage.empty()) {
+        cout << "cannot read " << imageName << endl;
+        return 1;
+    }
+    const bool rgbOrder = mapped.rgbOrder && !mapped.image.empty();
+    if (options.benchGradients) {
+        benchGradients(coloredImage, rgbOrder);
+        return 0;
+    }
+    if (options.checkDeterminism) {
+        return checkDeterminism(options, coloredImage, rgbOrder);
+    }
+    Mat angles, magnitudes;
+    calcGradients(coloredImage, angles, magnitudes, options.gradient, options.fixedPoint, rgbOrder);
+    saveMap(options, imageName + "_original_grad" + options.imageExtension, angles, magnitudes);
+
+    if (options.sweep.enabled()) {
+        runSweep(options, coloredImage, angles, magnitudes);
+        return 0;
+    }
+    if (options.compareEngines) {
+        compareEngines(options, coloredImage, rgbOrder, angles, magnitudes);
+        return 0;
+    }
+
+    Tiling tiling = defaultTiling;
+    if (options.autotune) {
+        const string cacheName = tuneCachePath(options);
+        const string fingerprint = machineFingerprint();
+        const string bucket = tuneBucket(options, coloredImage);
+        TunedConfig tuned;
+        if (loadTuning(cacheName, fingerprint, bucket, tuned)) {
+            setThreads(tuned.threads);
+            cout << "autotune: reusing " << bucket << " from " << cacheName << endl;
+        } else {
+            tuned = autotune(options, coloredImage, rgbOrder, angles, magnitudes);
+            storeTuning(cacheName, fingerprint, bucket, tuned);
+        }
+        tiling = tuned.tiling;
+        cout << "autotune: " << tuned.threads << " threads, " << tiling.rows << "x"
+             << (tiling.cols ? to_string(tiling.cols) : "row") << " tiles, "
+             << tuned.msPerIteration << " ms/iter on the crop" << endl;
+    }
+
+    // with --video the per-snapshot .jpg/.txt pairs become video frames and
+    // only the final field is written as text
+    SnapshotVideo* video = 0;
+    if (!options.videoName.empty()) {
+        video = new SnapshotVideo(options.videoName, options.videoCodec, coloredImage.size());
+        if (!video->isOpened()) {
+            cout << "cannot open video " << options.videoName << endl;
+            delete video;
+            return 1;
+        }
+        video->append(renderAngleGraph(angles, magnitudes, 0.0f));
+    }
+
+    if (options.bands > 1) {
+        const int status = runBands(options, coloredImage, angles, magnitudes, video);
+        delete video;
+        return status;
+    }
+
+    Mat nextAngles = angles.clone();
+    Mat nextMagnitudes = magnitudes.clone();
+    BilateralGrid* grid = 0;
+    if (options.engine == "grid") {
+        grid = new BilateralGrid(coloredImage, options.filterParams, rgbOrder);
+    }
+
+    // anytime: with --budget (counted from the start of the run) or on
+    // SIGUSR1 the loop ends early, and the last complete field is the result
+    CancelToken& cancel = signalCancelToken;
+    cancel.reset();
+    if (options.budgetSeconds > 0) {
+        cancel.setBudget(options.budgetSeconds - (getTickCount() - start) / getTickFrequency());
+    }
+    signal(SIGUSR1, cancelOnSignal);
+    const BilateralWeights weights(options.filterParams, coloredImage.type());
+    int completed = 0;
+    double lastSeconds = 0;
+    while (completed < iterationTimes && cancel.fits(lastSeconds)) {
+        const int64 iterationStart = getTickCount();
+        if (grid) {
+            iterateGrid(*grid, angles, magnitudes, nextAngles, nextMagnitudes);
+        } else if (!iterate(options.filterParams, weights, angles, magnitudes, nextAngles, nextMagnitudes,
+                            coloredImage, tiling, &cancel)) {
+            break;
+        }
+        lastSeconds = (getTickCount() - iterationStart) / getTickFrequency();
+        cout << "iter " << ++completed << endl;
+        saveIteration(options, completed, angles, magnitudes, video);
+    }
+    if (completed < iterationTimes) {
+        cout << (cancel.cancelled() ? "cancelled" : "budget spent") << " after " << completed << " of "
+             << iterationTimes << " iterations" << endl;
+        if (video || completed % options.saveStep != 0) {
+            saveIteration(options, completed, angles, magnitudes, video, true);
+        }
+    }
+    delete grid;
+    delete video;
+    if (options.syntheticRows > 0) {
+        // the figure the pgo target compares builds by
+        cout << "benchmark: " << (getTickCount() - start) / getTickFrequency() * 1000 << " ms" << endl;
+    }
+    return 0;
+}
+
+FieldSolver::FieldSolver (const Mat& image_, bool rgbOrder, const FilterParams& params_, GradientOperator op, bool useGrid)
+    : image(image_)
+    , params(params_)
+    , weights(params_, image_.type())
+    , grid(0)
+{
+    calcGradients(image, angles, magnitudes, op, false, rgbOrder);
+    nextAngles.create(angles.size(), CV_32F);
+    nextMagnitudes.create(magnitudes.size(), CV_32F);
+    if (useGrid) {
+        grid = new BilateralGrid(image, params, rgbOrder);
+    }
+}
+
+FieldSolver::~FieldSolver ()
+{
+    delete grid;
+}
+
+int FieldSolver::iterate (int times, double budgetSeconds)
+{
+    CancelRun run(cancelToken, budgetSeconds);
+    // iterate swaps headers; these locals take the swaps so the members
+    // keep their buffers, and an odd count costs one copy back
+    Mat a = angles, m = magnitudes, nextA = nextAngles, nextM = nextMagnitudes;
+    int completed = 0;
+    for (; completed < times && !cancelToken.stopped(); ++completed) {
+        if (grid) {
+            iterateGrid(*grid, a, m, nextA, nextM);
+        } else if (!::iterate(params, weights, a, m, nextA, nextM, image, defaultTiling, &cancelToken)) {
+            break;
+        }
+    }
+    if (a.data != angles.data) {
+        a.copyTo(angles);
+        m.copyTo(magnitudes);
+    }
+    return completed;
+}
+
+#ifndef ORIENT_NO_MAIN
+int main(const int argc, const char* argv[])
+{
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        return argc < 4 ? 0 : 1;
+    }
+    if (!options.unpackName.empty()) {
+        return runUnpack(options.imageName, options.unpackName);
+    }
+    // one pack per process, so workers sharing a spool never append to the same file
+    PackWriter pack;
+    if (!options.packDir.empty()) {
+        mkdir(options.packDir.c_str(), 0777);
+        if (!pack.open(options.packDir + "/" + spoolWorkerId())) {
+            cout << "cannot open a pack in " << options.packDir << endl;
+            return 1;
+        }
+        options.pack = &pack;
+    }
+    FileIo* io = 0;
+    if (!options.ioBackend.empty()) {
+        io = openFileIo(options.ioBackend);
+        options.io = io;
+    }
+    int status;
+    if (!options.spool.empty()) {
+        status = options.coordinator ? runSpoolCoordinator(options) : runSpoolWorker(options);
+    } else if (options.stream) {
+        status = runStream(options);
+    } else if (options.sequence) {
+        status = runSequence(options);
+    } else if (options.strips) {
+        status = runStrips(options);
+    } else {
+        status = runImage(options);
+    }
+    if (io && !io->drain()) {
+        status = 1;
+    }
+    delete io;
+    return status;
+}
+#endif
+
@@ -0,0 +1,138 @@
+// the C interface of liborient.so (built with -DORIENT_LIBRARY=ON), for
+// calling the solver in-process from C, Go, Rust, ...
+//
+//     orient_params params;
+//     orient_default_params(&params);
+//     orient_solver* solver;
+//     orient_create(&params, rows, cols, ORIENT_U8, 3, &solver);
+//     orient_gradients(solver, &image, &field);
+//     orient_iterate(solver, &image, &field, 10);
+//     orient_destroy(solver);
+//
+// images and fields are the caller's memory, described by pointer, size and
+// row stride. orient_create sizes every scratch buffer for the largest image
+// the solver will see, so gradients and iterations allocate nothing (beyond
+// a thread's first use of the library). a solver serializes calls made on it
+// from several threads; separate solvers run concurrently.
+#ifndef ORIENT_H
+#define ORIENT_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define ORIENT_API __attribute__((visibility("default")))
+#else
+#define ORIENT_API
+#endif
+
+// bumped whenever a declaration here changes incompatibly
+#define ORIENT_ABI_VERSION 1
+
+// the status the calls that can fail return
+enum {
+    ORIENT_OK = 0,
+    // a null pointer, an image larger than the solver or of another
+    // type, a stride shorter than a row, bad parameters
+    ORIENT_ERROR_ARGUMENT = 1,
+    ORIENT_ERROR_MEMORY = 2,
+    ORIENT_ERROR_INTERNAL = 3,
+    // orient_cancel stopped the call; the field holds the last complete
+    // iteration
+    ORIENT_CANCELLED = 4
+};
+
+// pixel depths
+enum {
+    ORIENT_U8 = 0,
+    ORIENT_U16 = 1,
+    ORIENT_F32 = 2
+};
+
+// gradient operators, as --gradient names them. the structure tensor and
+// the grid engine need whole-image temporaries and stay in the command line
+// tool.
+enum {
+    ORIENT_SCHARR = 0,
+    ORIENT_SOBEL3 = 1,
+    ORIENT_SOBEL5 = 2,
+    ORIENT_SOBEL7 = 3,
+    ORIENT_CENTRAL = 4
+};
+
+// later versions only add fields at the end. size is the caller's
+// sizeof(orient_params), set by orient_default_params: the library takes
+// the fields an older caller leaves out at their defaults, and a newer
+// caller's fields that it does not know must be zero.
+typedef struct orient_params {
+    size_t size;
+    // odd bilateral window, and its spatial and color (0-255 scale) sigmas
+    int kernel_size;
+    float spatial_sigma;
+    float color_sigma;
+    int gradient;
+    // int16 gradients for 8-bit images where the operator fits (not sobel7)
+    int fixed_point;
+    // OpenMP threads per call, 0 for the OpenMP default
+    int threads;
+} orient_params;
+
+typedef struct orient_image {
+    const void* pixels;
+    int rows;
+    int cols;
+    // bytes from one row to the next
+    size_t stride;
+    // 3-channel pixels are RGB rather than BGR
+    int rgb;
+} orient_image;
+
+// angles (radians in [-pi/2, pi/2)) and gradient magnitudes, one float per
+// pixel each. the field is read and rewritten in place by orient_iterate.
+typedef struct orient_field {
+    float* angles;
+    float* magnitudes;
+    // bytes from one row to the next, in both arrays
+    size_t stride;
+} orient_field;
+
+typedef struct orient_solver orient_solver;
+
+ORIENT_API int orient_abi_version (void);
+ORIENT_API const char* orient_status_string (int status);
+ORIENT_API int orient_default_params (orient_params* params);
+
+// a solver for images of up to max_rows x max_cols pixels of the given
+// depth and channel count (1 for grey or 3)
+ORIENT_API int orient_create (const orient_params* params, int max_rows, int max_cols, int depth, int channels,
+                              orient_solver** solver);
+ORIENT_API void orient_destroy (orient_solver* solver);
+
+// writes image's gradients to field, the start of the iterations
+ORIENT_API int orient_gradients (orient_solver* solver, const orient_image* image, const orient_field* field);
+
+// runs times iterations on field, guided by the same image
+ORIENT_API int orient_iterate (orient_solver* solver, const orient_image* image, const orient_field* field,
+                               int times);
+
+// anytime iterations: as many as fit in budget_seconds of wall-clock time
+// (0: no limit), up to max_times. the field is left at the last complete
+// iteration, and completed (if not null) says how many that was.
+ORIENT_API int orient_iterate_budget (orient_solver* solver, const orient_image* image, const orient_field* field,
+                                      int max_times, double budget_seconds, int* completed);
+
+// stops the orient_iterate or orient_iterate_budget call running on
+// solver, from any thread, within a tile of work (about a row
+// of pixels per thread); it then returns ORIENT_CANCELLED. with no call
+// running, it stops the next one before its first iteration, so a cancel
+// racing the start of a call is never lost. never blocks.
+ORIENT_API int orient_cancel (orient_solver* solver);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
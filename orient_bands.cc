@@ -0,0 +1,564 @@
+// the band workers and the transports between them
+#include "orient_bands.h"
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#ifdef _OPENMP
+#include <dlfcn.h>
+#endif
+
+// moves halo rows between neighboring band workers, and snapshots of every
+// band to the coordinator. it is set up before the workers are forked, then
+// each process attaches to its own end. a worker that dies closes its ends,
+// so its peers and the coordinator fail instead of waiting forever.
+class BandTransport {
+public:
+    virtual ~BandTransport () {}
+    virtual bool isOpened () const = 0;
+    virtual bool attachWorker (int band) = 0;
+    virtual bool attachCoordinator () = 0;
+    // sends one halo to the neighboring band peer and receives one from it
+    virtual bool exchange (int peer, const vector<float>& outgoing, vector<float>& incoming) = 0;
+    // rows [r0, r0 + angles.rows) of the next snapshot
+    virtual bool deliver (int r0, const Mat& angles, const Mat& magnitudes) = 0;
+    // the next snapshot, once every band has delivered it
+    virtual bool collect (Mat& angles, Mat& magnitudes) = 0;
+};
+
+// halos and snapshots go through one shared anonymous mapping; pipes carry
+// only one-byte tokens saying a slot is full. each link has two slots used
+// alternately: a sender can only get a message ahead of its peer, never two.
+// a worker waits for the coordinator's ack after delivering a snapshot.
+class ShmTransport : public BandTransport {
+public:
+    ShmTransport (int bands, int haloFloats, int rows, int cols);
+    ~ShmTransport ();
+    bool isOpened () const;
+    bool attachWorker (int band);
+    bool attachCoordinator ();
+    bool exchange (int peer, const vector<float>& outgoing, vector<float>& incoming);
+    bool deliver (int r0, const Mat& angles, const Mat& magnitudes);
+    bool collect (Mat& angles, Mat& magnitudes);
+private:
+    int bands;
+    int band;
+    int haloFloats;
+    int rows;
+    int cols;
+    float* shared;
+    size_t sharedBytes;
+    // one pipe per directed link, then the done pipe, then one ack pipe per band
+    vector<int> fds;
+    vector<long> messages;
+    int link (int from, int to) const;
+    float* slot (int link, long message) const;
+    float* result () const;
+    void closeAllBut (const vector<int>& keep);
+};
+
+ShmTransport::ShmTransport (int bands_, int haloFloats_, int rows_, int cols_)
+    : bands(bands_)
+    , band(-1)
+    , haloFloats(haloFloats_)
+    , rows(rows_)
+    , cols(cols_)
+    , shared(0)
+    , sharedBytes((4 * size_t(bands) * haloFloats + 2 * size_t(rows) * cols) * sizeof(float))
+    , messages(2 * bands, 0)
+{
+    void* p = mmap(0, sharedBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return;
+    }
+    shared = static_cast<float*>(p);
+    for (int i = 0; i < 3 * bands + 1; ++i) {
+        int ends[2];
+        if (pipe(ends) != 0) {
+            munmap(shared, sharedBytes);
+            shared = 0;
+            return;
+        }
+        fds.push_back(ends[0]);
+        fds.push_back(ends[1]);
+    }
+}
+
+ShmTransport::~ShmTransport ()
+{
+    closeAllBut(vector<int>());
+    if (shared) {
+        munmap(shared, sharedBytes);
+    }
+}
+
+bool ShmTransport::isOpened () const
+{
+    return shared != 0;
+}
+
+int ShmTransport::link (int from, int to) const
+{
+    return 2 * from + (to > from ? 1 : 0);
+}
+
+float* ShmTransport::slot (int link, long message) const
+{
+    return shared + (2 * size_t(link) + message % 2) * haloFloats;
+}
+
+float* ShmTransport::result () const
+{
+    return shared + 4 * size_t(bands) * haloFloats;
+}
+
+void ShmTransport::closeAllBut (const vector<int>& keep)
+{
+    for (size_t i = 0; i < fds.size(); ++i) {
+        if (fds[i] >= 0 && find(keep.begin(), keep.end(), fds[i]) == keep.end()) {
+            close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+}
+
+bool ShmTransport::attachWorker (int band_)
+{
+    band = band_;
+    vector<int> keep;
+    for (int peer = band - 1; peer <= band + 1; peer += 2) {
+        if (peer >= 0 && peer < bands) {
+            keep.push_back(fds[2 * link(band, peer) + 1]);
+            keep.push_back(fds[2 * link(peer, band)]);
+        }
+    }
+    keep.push_back(fds[4 * bands + 1]);
+    keep.push_back(fds[4 * bands + 2 + 2 * band]);
+    closeAllBut(keep);
+    return true;
+}
+
+bool ShmTransport::attachCoordinator ()
+{
+    vector<int> keep(1, fds[4 * bands]);
+    for (int b = 0; b < bands; ++b) {
+        keep.push_back(fds[4 * bands + 2 + 2 * b + 1]);
+    }
+    closeAllBut(keep);
+    return true;
+}
+
+bool ShmTransport::exchange (int peer, const vector<float>& outgoing, vector<float>& incoming)
+{
+    const int out = link(band, peer);
+    const int in = link(peer, band);
+    const char token = 0;
+    char received;
+    memcpy(slot(out, messages[out]++), outgoing.data(), haloFloats * sizeof(float));
+    if (!writeAll(fds[2 * out + 1], &token, 1) || !readAll(fds[2 * in], &received, 1)) {
+        return false;
+    }
+    incoming.resize(haloFloats);
+    memcpy(incoming.data(), slot(in, messages[in]++), haloFloats * sizeof(float));
+    return true;
+}
+
+bool ShmTransport::deliver (int r0, const Mat& angles, const Mat& magnitudes)
+{
+    float* resultAngles = result();
+    float* resultMagnitudes = resultAngles + size_t(rows) * cols;
+    for (int r = 0; r < angles.rows; ++r) {
+        memcpy(resultAngles + size_t(r0 + r) * cols, angles.ptr(r), cols * sizeof(float));
+        memcpy(resultMagnitudes + size_t(r0 + r) * cols, magnitudes.ptr(r), cols * sizeof(float));
+    }
+    const char token = 0;
+    char ack;
+    return writeAll(fds[4 * bands + 1], &token, 1) && readAll(fds[4 * bands + 2 + 2 * band], &ack, 1);
+}
+
+bool ShmTransport::collect (Mat& angles, Mat& magnitudes)
+{
+    char token;
+    for (int b = 0; b < bands; ++b) {
+        if (!readAll(fds[4 * bands], &token, 1)) {
+            return false;
+        }
+    }
+    Mat(rows, cols, CV_32F, result()).copyTo(angles);
+    Mat(rows, cols, CV_32F, result() + size_t(rows) * cols).copyTo(magnitudes);
+    for (int b = 0; b < bands; ++b) {
+        if (!writeAll(fds[4 * bands + 2 + 2 * b + 1], &token, 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// every band listens on 127.0.0.1 and connects to the next band's listener;
+// every worker also connects to the coordinator, which reads the snapshots
+// in band order. a socket that fills up blocks its writer, so of the two
+// ends of a link the lower band sends first and the upper one receives first.
+class TcpTransport : public BandTransport {
+public:
+    TcpTransport (int bands);
+    ~TcpTransport ();
+    bool isOpened () const;
+    bool attachWorker (int band);
+    bool attachCoordinator ();
+    bool exchange (int peer, const vector<float>& outgoing, vector<float>& incoming);
+    bool deliver (int r0, const Mat& angles, const Mat& magnitudes);
+    bool collect (Mat& angles, Mat& magnitudes);
+private:
+    int bands;
+    int band;
+    // one listener per band, then the coordinator's
+    vector<int> listeners;
+    vector<int> ports;
+    int up;
+    int down;
+    int coordinator;
+    // the coordinator's connection from each band
+    vector<int> workers;
+    int connectTo (int port) const;
+    void closeListeners ();
+};
+
+TcpTransport::TcpTransport (int bands_)
+    : bands(bands_)
+    , band(-1)
+    , up(-1)
+    , down(-1)
+    , coordinator(-1)
+    , workers(bands_, -1)
+{
+    for (int i = 0; i <= bands; ++i) {
+        const int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = 0;
+        socklen_t length = sizeof(address);
+        if (fd < 0 || ::bind(fd, (sockaddr*)&address, sizeof(address)) != 0
+            || listen(fd, bands) != 0 || getsockname(fd, (sockaddr*)&address, &length) != 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            closeListeners();
+            return;
+        }
+        listeners.push_back(fd);
+        ports.push_back(ntohs(address.sin_port));
+    }
+}
+
+TcpTransport::~TcpTransport ()
+{
+    closeListeners();
+    const int sockets[] = {up, down, coordinator};
+    for (int i = 0; i < 3; ++i) {
+        if (sockets[i] >= 0) {
+            close(sockets[i]);
+        }
+    }
+    for (int b = 0; b < bands; ++b) {
+        if (workers[b] >= 0) {
+            close(workers[b]);
+        }
+    }
+}
+
+bool TcpTransport::isOpened () const
+{
+    return int(listeners.size()) == bands + 1;
+}
+
+void TcpTransport::closeListeners ()
+{
+    for (size_t i = 0; i < listeners.size(); ++i) {
+        if (listeners[i] >= 0) {
+            close(listeners[i]);
+            listeners[i] = -1;
+        }
+    }
+}
+
+int TcpTransport::connectTo (int port) const
+{
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    const int noDelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    return fd;
+}
+
+bool TcpTransport::attachWorker (int band_)
+{
+    band = band_;
+    coordinator = connectTo(ports[bands]);
+    if (coordinator < 0 || !writeAll(coordinator, &band, sizeof(band))) {
+        return false;
+    }
+    // the next band's listener queues this connection until it accepts it
+    if (band + 1 < bands && (down = connectTo(ports[band + 1])) < 0) {
+        return false;
+    }
+    if (band > 0 && (up = accept(listeners[band], 0, 0)) < 0) {
+        return false;
+    }
+    closeListeners();
+    return true;
+}
+
+bool TcpTransport::attachCoordinator ()
+{
+    for (int i = 0; i < bands; ++i) {
+        const int fd = accept(listeners[bands], 0, 0);
+        int from = -1;
+        if (fd < 0 || !readAll(fd, &from, sizeof(from)) || from < 0 || from >= bands) {
+            return false;
+        }
+        workers[from] = fd;
+    }
+    closeListeners();
+    return true;
+}
+
+bool TcpTransport::exchange (int peer, const vector<float>& outgoing, vector<float>& incoming)
+{
+    const int fd = peer < band ? up : down;
+    const size_t bytes = outgoing.size() * sizeof(float);
+    incoming.resize(outgoing.size());
+    if (band < peer) {
+        return writeAll(fd, outgoing.data(), bytes) && readAll(fd, incoming.data(), bytes);
+    }
+    return readAll(fd, incoming.data(), bytes) && writeAll(fd, outgoing.data(), bytes);
+}
+
+bool TcpTransport::deliver (int r0, const Mat& angles, const Mat& magnitudes)
+{
+    const int header[2] = {r0, angles.rows};
+    if (!writeAll(coordinator, header, sizeof(header))) {
+        return false;
+    }
+    for (int r = 0; r < angles.rows; ++r) {
+        if (!writeAll(coordinator, angles.ptr(r), angles.cols * sizeof(float))
+            || !writeAll(coordinator, magnitudes.ptr(r), magnitudes.cols * sizeof(float))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool TcpTransport::collect (Mat& angles, Mat& magnitudes)
+{
+    for (int b = 0; b < bands; ++b) {
+        int header[2];
+        if (!readAll(workers[b], header, sizeof(header))
+            || header[0] < 0 || header[1] < 0 || header[0] + header[1] > angles.rows) {
+            return false;
+        }
+        for (int r = header[0]; r < header[0] + header[1]; ++r) {
+            if (!readAll(workers[b], angles.ptr(r), angles.cols * sizeof(float))
+                || !readAll(workers[b], magnitudes.ptr(r), magnitudes.cols * sizeof(float))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// h rows of angles then h rows of magnitudes, starting at local row from
+void packHalo (const Mat& angles, const Mat& magnitudes, int from, int h, vector<float>& halo)
+{
+    const int cols = angles.cols;
+    halo.resize(2 * size_t(h) * cols);
+    for (int i = 0; i < h; ++i) {
+        memcpy(&halo[size_t(i) * cols], angles.ptr(from + i), cols * sizeof(float));
+        memcpy(&halo[size_t(h + i) * cols], magnitudes.ptr(from + i), cols * sizeof(float));
+    }
+}
+
+void unpackHalo (const vector<float>& halo, int to, int h, Mat& angles, Mat& magnitudes)
+{
+    const int cols = angles.cols;
+    for (int i = 0; i < h; ++i) {
+        memcpy(angles.ptr(to + i), &halo[size_t(i) * cols], cols * sizeof(float));
+        memcpy(magnitudes.ptr(to + i), &halo[size_t(h + i) * cols], cols * sizeof(float));
+    }
+}
+
+// iterates rows [r0, r1) of the field, keeping kernelSize/2 halo rows on
+// each side up to date from the neighboring bands. updateCell clips its
+// kernel at the edges of the band's rows, which are the image's own edges
+// wherever there is no halo, so every row comes out as in iterate.
+int runBandWorker (const Options& options, BandTransport& transport, int band, int bands,
+                   const Mat& coloredImage, const Mat& angles, const Mat& magnitudes)
+{
+    const FilterParams& params = options.filterParams;
+    const int h = params.kernelSize / 2;
+    const int rows = angles.rows;
+    const int cols = angles.cols;
+    const int r0 = int(long(rows) * band / bands);
+    const int r1 = int(long(rows) * (band + 1) / bands);
+    const int l0 = max(0, r0 - h);
+    const int l1 = min(rows, r1 + h);
+    Mat bandAngles = angles.rowRange(l0, l1).clone();
+    Mat bandMagnitudes = magnitudes.rowRange(l0, l1).clone();
+    Mat nextAngles = bandAngles.clone();
+    Mat nextMagnitudes = bandMagnitudes.clone();
+    const Mat window = coloredImage.rowRange(l0, l1);
+    const BilateralWeights weights(params, coloredImage.type());
+    vector<float> outgoing, incoming;
+
+    for (int i = 0; i < options.iterationTimes; ++i) {
+        #pragma omp parallel for schedule(dynamic)
+        for (int r = r0; r < r1; ++r) {
+            for (int c = 0; c < cols; ++c) {
+                updateCell(r - l0, c, params, weights, nextAngles, nextMagnitudes,
+                           bandAngles, bandMagnitudes, window);
+            }
+        }
+        swap(bandAngles, nextAngles);
+        swap(bandMagnitudes, nextMagnitudes);
+
+        // bands (0,1), (2,3), ... trade halos first, then (1,2), (3,4), ...
+        for (int phase = 0; phase < 2; ++phase) {
+            const int peer = band % 2 == phase ? band + 1 : band - 1;
+            if (h == 0 || peer < 0 || peer >= bands) {
+                continue;
+            }
+            packHalo(bandAngles, bandMagnitudes, (peer < band ? r0 : r1 - h) - l0, h, outgoing);
+            if (!transport.exchange(peer, outgoing, incoming)) {
+                return 1;
+            }
+            unpackHalo(incoming, (peer < band ? r0 - h : r1) - l0, h, bandAngles, bandMagnitudes);
+        }
+
+        if ((i+1) % options.saveStep == 0 || i+1 == options.iterationTimes) {
+            if (!transport.deliver(r0, bandAngles.rowRange(r0 - l0, r1 - l0),
+                                   bandMagnitudes.rowRange(r0 - l0, r1 - l0))) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// true if OpenMP can start threads in a child forked after the parent has
+// used it. LLVM's libomp (the one defining __kmpc_fork_call) resets itself
+// in the child; libgomp keeps a pool of threads that did not survive the
+// fork and deadlocks waiting for them, though a team of one still runs.
+bool openMpSurvivesFork ()
+{
+#ifdef _OPENMP
+    return dlsym(RTLD_DEFAULT, "__kmpc_fork_call") != 0;
+#else
+    return true;
+#endif
+}
+
+// forks one worker per band of rows; the workers inherit the image and the
+// gradients, iterate their bands and trade halos through the transport, and
+// this process gathers their snapshots and saves them as main would. the
+// parent has run OpenMP by then (the gradients), so under libgomp each
+// worker is limited to one thread, and --bands is the only parallelism.
+int runBands (const Options& options, const Mat& coloredImage, Mat& angles, Mat& magnitudes,
+              SnapshotVideo* video)
+{
+    const int h = options.filterParams.kernelSize / 2;
+    // every band has to be at least as tall as the halo it sends
+    const int bands = max(1, min(options.bands, angles.rows / max(1, h)));
+    BandTransport* transport = 0;
+    if (options.transport == "tcp") {
+        transport = new TcpTransport(bands);
+    } else {
+        transport = new ShmTransport(bands, 2 * h * angles.cols, angles.rows, angles.cols);
+    }
+    if (!transport->isOpened()) {
+        cout << "cannot set up the " << options.transport << " transport" << endl;
+        delete transport;
+        return 1;
+    }
+    cout << "iterating in " << bands << " bands over " << options.transport << endl;
+    const bool singleThreaded = !openMpSurvivesFork();
+    if (singleThreaded && maxThreads() > 1) {
+        cout << "this OpenMP runtime cannot start threads after fork(): one thread per band" << endl;
+    }
+
+    // a dead peer shows up as a failed write instead of killing the writer;
+    // the caller's disposition comes back once the bands are done
+    struct sigaction ignorePipe, callerPipe;
+    memset(&ignorePipe, 0, sizeof(ignorePipe));
+    ignorePipe.sa_handler = SIG_IGN;
+    sigemptyset(&ignorePipe.sa_mask);
+    sigaction(SIGPIPE, &ignorePipe, &callerPipe);
+    cout.flush();
+    vector<pid_t> workers;
+    bool ok = true;
+    for (int b = 0; ok && b < bands; ++b) {
+        const pid_t pid = fork();
+        if (pid == 0) {
+            if (singleThreaded) {
+                setThreads(1);
+            }
+            int status = 1;
+            if (transport->attachWorker(b)) {
+                status = runBandWorker(options, *transport, b, bands, coloredImage, angles, magnitudes);
+            }
+            cout.flush();
+            _exit(status);
+        }
+        if (pid < 0) {
+            cout << "cannot fork band " << b << endl;
+            ok = false;
+        } else {
+            workers.push_back(pid);
+        }
+    }
+
+    ok = ok && transport->attachCoordinator();
+    for (int i = 0; ok && i < options.iterationTimes; ++i) {
+        if ((i+1) % options.saveStep == 0 || i+1 == options.iterationTimes) {
+            cout << "iter " << i+1 << endl;
+            ok = transport->collect(angles, magnitudes);
+            if (ok) {
+                saveIteration(options, i+1, angles, magnitudes, video);
+            }
+        }
+    }
+    if (!ok) {
+        for (size_t i = 0; i < workers.size(); ++i) {
+            kill(workers[i], SIGTERM);
+        }
+    }
+    for (size_t i = 0; i < workers.size(); ++i) {
+        int status = 0;
+        waitpid(workers[i], &status, 0);
+        ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    delete transport;
+    sigaction(SIGPIPE, &callerPipe, 0);
+    if (!ok) {
+        cout << "a band worker failed" << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,13 @@
+// --bands: one forked worker per band of rows, trading halos over shared
+// memory or TCP, see orient_bands.cc
+#ifndef ORIENT_BANDS_H
+#define ORIENT_BANDS_H
+
+#include "orient_core.h"
+
+// iterates angles and magnitudes in options.bands processes and saves their
+// snapshots like runImage; 0 on success
+int runBands (const Options& options, const Mat& coloredImage, Mat& angles, Mat& magnitudes,
+              SnapshotVideo* video);
+
+#endif
@@ -0,0 +1,221 @@
+// liborient.so, built with -DORIENT_LIBRARY=ON: orient.h's C interface over
+// the solver in orient.cc. the build hides every other symbol, so the
+// library exports the orient_* functions and nothing else.
+#include "orient.h"
+
+#include "orient_solver.h"
+
+struct orient_solver {
+    const FilterParams params;
+    const GradientOperator op;
+    const bool fixedPoint;
+    const int threads;
+    const int maxRows;
+    const int maxCols;
+    const int type;
+    const BilateralWeights weights;
+    // iterate writes every other iteration here; views of their top left
+    // corner serve smaller images
+    Mat nextAngles;
+    Mat nextMagnitudes;
+    mutex lock;
+    // set by orient_cancel without the lock
+    CancelToken cancel;
+    orient_solver (const orient_params& p, int maxRows_, int maxCols_, int type_);
+};
+
+orient_solver::orient_solver (const orient_params& p, int maxRows_, int maxCols_, int type_)
+    : params(p.kernel_size, p.spatial_sigma, p.color_sigma)
+    , op(GradientOperator(p.gradient))
+    , fixedPoint(p.fixed_point != 0)
+    , threads(p.threads)
+    , maxRows(maxRows_)
+    , maxCols(maxCols_)
+    , type(type_)
+    , weights(params, type_)
+    , nextAngles(maxRows_, maxCols_, CV_32F)
+    , nextMagnitudes(maxRows_, maxCols_, CV_32F) {}
+
+// the caller's params as this library's orient_params: fields an older
+// caller does not have keep their defaults. false if size cannot be a
+// caller's orient_params, or a newer caller set a field unknown here.
+bool readParams (const orient_params* caller, orient_params& params)
+{
+    const size_t firstVersion = offsetof(orient_params, threads) + sizeof(caller->threads);
+    if (!caller || caller->size < firstVersion) {
+        return false;
+    }
+    const uchar* bytes = reinterpret_cast<const uchar*>(caller);
+    for (size_t i = sizeof(orient_params); i < caller->size; ++i) {
+        if (bytes[i] != 0) {
+            return false;
+        }
+    }
+    orient_default_params(&params);
+    memcpy(&params, caller, min(caller->size, sizeof(orient_params)));
+    params.size = sizeof(orient_params);
+    return true;
+}
+
+// headers over the caller's image and field; false if they do not fit the
+// solver. no memory is allocated or copied.
+bool wrapCallerMemory (const orient_solver& solver, const orient_image* image, const orient_field* field,
+                       Mat& pixels, Mat& angles, Mat& magnitudes)
+{
+    if (!image || !field || !image->pixels || !field->angles || !field->magnitudes) {
+        return false;
+    }
+    const int rows = image->rows;
+    const int cols = image->cols;
+    const size_t pixelBytes = CV_ELEM_SIZE(solver.type);
+    if (rows < 1 || cols < 1 || rows > solver.maxRows || cols > solver.maxCols
+        || image->stride < cols * pixelBytes || image->stride % CV_ELEM_SIZE1(solver.type) != 0
+        || field->stride < cols * sizeof(float) || field->stride % sizeof(float) != 0) {
+        return false;
+    }
+    pixels = Mat(rows, cols, solver.type, const_cast<void*>(image->pixels), image->stride);
+    angles = Mat(rows, cols, CV_32F, field->angles, field->stride);
+    magnitudes = Mat(rows, cols, CV_32F, field->magnitudes, field->stride);
+    return true;
+}
+
+extern "C" {
+
+ORIENT_API int orient_abi_version (void)
+{
+    return ORIENT_ABI_VERSION;
+}
+
+ORIENT_API const char* orient_status_string (int status)
+{
+    switch (status) {
+    case ORIENT_OK:
+        return "ok";
+    case ORIENT_ERROR_ARGUMENT:
+        return "invalid argument";
+    case ORIENT_ERROR_MEMORY:
+        return "out of memory";
+    case ORIENT_ERROR_INTERNAL:
+        return "internal error";
+    case ORIENT_CANCELLED:
+        return "cancelled";
+    default:
+        return "unknown status";
+    }
+}
+
+ORIENT_API int orient_default_params (orient_params* params)
+{
+    if (!params) {
+        return ORIENT_ERROR_ARGUMENT;
+    }
+    params->size = sizeof(orient_params);
+    params->kernel_size = defaultFilterParams.kernelSize;
+    params->spatial_sigma = defaultFilterParams.spatialSigma;
+    params->color_sigma = defaultFilterParams.colorSigma;
+    params->gradient = ORIENT_SCHARR;
+    params->fixed_point = 0;
+    params->threads = 0;
+    return ORIENT_OK;
+}
+
+ORIENT_API int orient_create (const orient_params* params, int max_rows, int max_cols, int depth, int channels,
+                              orient_solver** solver)
+{
+    static const int depths[] = {CV_8U, CV_16U, CV_32F};
+    orient_params p;
+    if (!readParams(params, p) || !solver || max_rows < 1 || max_cols < 1 || depth < ORIENT_U8
+        || depth > ORIENT_F32 || (channels != 1 && channels != 3) || p.kernel_size < 1 || p.kernel_size % 2 == 0
+        || !(p.spatial_sigma > 0) || !(p.color_sigma > 0) || p.threads < 0
+        || p.gradient < ORIENT_SCHARR || p.gradient > ORIENT_CENTRAL) {
+        return ORIENT_ERROR_ARGUMENT;
+    }
+    try {
+        *solver = new orient_solver(p, max_rows, max_cols, CV_MAKETYPE(depths[depth], channels));
+        return ORIENT_OK;
+    } catch (const bad_alloc&) {
+        return ORIENT_ERROR_MEMORY;
+    } catch (...) {
+        return ORIENT_ERROR_INTERNAL;
+    }
+}
+
+ORIENT_API void orient_destroy (orient_solver* solver)
+{
+    delete solver;
+}
+
+ORIENT_API int orient_cancel (orient_solver* solver)
+{
+    if (!solver) {
+        return ORIENT_ERROR_ARGUMENT;
+    }
+    solver->cancel.cancel();
+    return ORIENT_OK;
+}
+
+ORIENT_API int orient_gradients (orient_solver* solver, const orient_image* image, const orient_field* field)
+{
+    Mat pixels, angles, magnitudes;
+    if (!solver || !wrapCallerMemory(*solver, image, field, pixels, angles, magnitudes)) {
+        return ORIENT_ERROR_ARGUMENT;
+    }
+    try {
+        lock_guard<mutex> guard(solver->lock);
+        TeamSize team(solver->threads);
+        calcGradients(pixels, angles, magnitudes, solver->op, solver->fixedPoint, image->rgb != 0);
+        return ORIENT_OK;
+    } catch (const bad_alloc&) {
+        return ORIENT_ERROR_MEMORY;
+    } catch (...) {
+        return ORIENT_ERROR_INTERNAL;
+    }
+}
+
+ORIENT_API int orient_iterate (orient_solver* solver, const orient_image* image, const orient_field* field,
+                               int times)
+{
+    return orient_iterate_budget(solver, image, field, times, 0, 0);
+}
+
+ORIENT_API int orient_iterate_budget (orient_solver* solver, const orient_image* image, const orient_field* field,
+                                      int max_times, double budget_seconds, int* completed)
+{
+    Mat pixels, angles, magnitudes;
+    if (completed) {
+        *completed = 0;
+    }
+    if (!solver || max_times < 0 || !(budget_seconds >= 0)
+        || !wrapCallerMemory(*solver, image, field, pixels, angles, magnitudes)) {
+        return ORIENT_ERROR_ARGUMENT;
+    }
+    try {
+        lock_guard<mutex> guard(solver->lock);
+        TeamSize team(solver->threads);
+        CancelToken& cancel = solver->cancel;
+        CancelRun run(cancel, budget_seconds);
+        const Rect used(0, 0, pixels.cols, pixels.rows);
+        Mat a = angles, m = magnitudes;
+        Mat nextA = solver->nextAngles(used), nextM = solver->nextMagnitudes(used);
+        int done = 0;
+        while (done < max_times && iterate(solver->params, solver->weights, a, m, nextA, nextM, pixels,
+                                           defaultTiling, &cancel)) {
+            ++done;
+        }
+        // an odd count leaves the field in the solver's buffers
+        if (a.data != angles.data) {
+            a.copyTo(angles);
+            m.copyTo(magnitudes);
+        }
+        if (completed) {
+            *completed = done;
+        }
+        return done < max_times && cancel.cancelled() ? ORIENT_CANCELLED : ORIENT_OK;
+    } catch (const bad_alloc&) {
+        return ORIENT_ERROR_MEMORY;
+    } catch (...) {
+        return ORIENT_ERROR_INTERNAL;
+    }
+}
+
+}
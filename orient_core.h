@@ -0,0 +1,205 @@
+// declarations shared by orient.cc and the modules split out of it. each
+// module has its own small header on top of this one (orient_io.h, ...).
+#ifndef ORIENT_CORE_H
+#define ORIENT_CORE_H
+
+#include <iostream>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+using namespace std;
+using namespace cv;
+
+// bounded producer/consumer queue; pop() returns false once the queue is
+// closed and drained
+template <typename T>
+class BlockingQueue {
+public:
+    explicit BlockingQueue (size_t capacity_);
+    void push (const T& item);
+    bool pop (T& item);
+    void close ();
+private:
+    const size_t capacity;
+    deque<T> items;
+    bool closed;
+    mutex lock;
+    condition_variable notEmpty;
+    condition_variable notFull;
+};
+
+template <typename T>
+BlockingQueue<T>::BlockingQueue (size_t capacity_)
+    : capacity(capacity_)
+    , closed(false) {}
+
+template <typename T>
+void BlockingQueue<T>::push (const T& item)
+{
+    unique_lock<mutex> guard(lock);
+    notFull.wait(guard, [this] { return items.size() < capacity || closed; });
+    items.push_back(item);
+    notEmpty.notify_one();
+}
+
+template <typename T>
+bool BlockingQueue<T>::pop (T& item)
+{
+    unique_lock<mutex> guard(lock);
+    notEmpty.wait(guard, [this] { return !items.empty() || closed; });
+    if (items.empty()) {
+        return false;
+    }
+    item = items.front();
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+}
+
+template <typename T>
+void BlockingQueue<T>::close ()
+{
+    lock_guard<mutex> guard(lock);
+    closed = true;
+    notEmpty.notify_all();
+    notFull.notify_all();
+}
+
+class FileIo;
+class PackWriter;
+class SnapshotVideo;
+
+class FilterParams {
+public:
+    int kernelSize;
+    float spatialSigma;
+    float colorSigma;
+    FilterParams (int kernelSize_, float spatialSigma_, float colorSigma_);
+};
+
+// kernel size 5, spatial sigma 2, color sigma 10
+extern const FilterParams defaultFilterParams;
+
+// spatial and range weights of the bilateral filter, tabulated once per
+// iteration instead of evaluating exp() per neighbor. the range gaussian of
+// the euclidean color distance factors into one gaussian per channel, so
+// integer images look it up by absolute channel difference (256 entries for
+// 8-bit, 65536 for 16-bit); float images evaluate it directly. works for any
+// channel count, so grey images need no conversion to BGR.
+class BilateralWeights {
+public:
+    BilateralWeights (const FilterParams& params, int type);
+    float spatial (int dr, int dc) const;
+    float color (const Mat& coloredImage, const Vec2i& p, const Vec2i& q) const;
+private:
+    const int radius;
+    const int depth;
+    const int channels;
+    const float colorSigma;
+    const float colorNorm;
+    vector<float> spatialTable;
+    vector<float> channelTable;
+};
+
+enum GradientOperator {
+    GRADIENT_SCHARR,
+    GRADIENT_SOBEL3,
+    GRADIENT_SOBEL5,
+    GRADIENT_SOBEL7,
+    GRADIENT_CENTRAL,
+    GRADIENT_TENSOR
+};
+
+// the --sweep-* lists
+class SweepGrid {
+public:
+    vector<float> kernelSizes;
+    vector<float> spatialSigmas;
+    vector<float> colorSigmas;
+    vector<float> iterations;
+    bool enabled () const;
+};
+
+class Options {
+public:
+    string imageName;
+    int iterationTimes;
+    int saveStep;
+    SweepGrid sweep;
+    // --kernel-size, --spatial-sigma and --color-sigma
+    FilterParams filterParams;
+    bool sequence;
+    int warmIterations;
+    float warmBlend;
+    string engine;
+    bool compareEngines;
+    GradientOperator gradient;
+    bool benchGradients;
+    bool fixedPoint;
+    bool stream;
+    string rawSpec;
+    bool strips;
+    int bands;
+    string transport;
+    string spool;
+    bool coordinator;
+    int leaseSeconds;
+    bool dzi;
+    string videoName;
+    string videoCodec;
+    string imageExtension;
+    int previewScale;
+    string packDir;
+    // set by main when --pack is given; snapshots go here instead of files
+    PackWriter* pack;
+    string unpackName;
+    bool autotune;
+    string tuneCache;
+    string isa;
+    int syntheticRows;
+    int syntheticCols;
+    bool checkDeterminism;
+    string ioBackend;
+    bool directIo;
+    // set by main when --async-io is given; snapshots are written through it
+    FileIo* io;
+    // the input, when it was read ahead (spool workers with --async-io)
+    vector<uchar> prefetched;
+    double budgetSeconds;
+    Options ();
+};
+
+// defined in orient.cc
+
+// OpenMP's thread count, and setting it for OpenMP and OpenCV alike
+int maxThreads ();
+void setThreads (int threads);
+// one cell of an iteration: the bilateral average of the neighbors of (r, c)
+// at least as strong as it, written to nextAngles and nextMagnitudes
+void updateCell (int r, int c, const FilterParams& params, const BilateralWeights& weights,
+                 Mat& nextAngles, Mat& nextMagnitudes,
+                 const Mat& angles, const Mat& magnitudes, const Mat& coloredImage);
+// saves the snapshot after iteration when it is due, see orient.cc
+void saveIteration (const Options& options, int iteration, const Mat& angles,
+                    const Mat& magnitudes, SnapshotVideo* video, bool stoppedEarly=false);
+
+// read and write all bytes, retrying interrupted calls; false on an error
+// or an early end of file
+bool readAll (int fd, void* data, size_t bytes);
+bool writeAll (int fd, const void* data, size_t bytes);
+// the rows and columns, then the rows of saveAngleToFile's format
+void writeAngles (ostream& out, const Mat& angles);
+// encodes image in the format of fileName's extension
+bool encodeImage (const string& fileName, const Mat& image, vector<uchar>& bytes);
+// .pgm, .ppm or .pnm, which are mapped rather than read
+bool isPnmFile (const string& fileName);
+// a whole run on options.imageName, in memory or in strips (--strips)
+int runImage (const Options& options);
+int runStrips (const Options& options);
+
+#endif
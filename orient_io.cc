@@ -0,0 +1,531 @@
+// the --async-io backends: a pool of threads doing blocking pread/pwrite, and
+// io_uring where the kernel has it
+#include "orient_io.h"
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#ifdef ORIENT_HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+// one read or write, from open to close
+class IoRequest {
+public:
+    int fd;
+    bool writing;
+    uchar* data;
+    size_t length;
+    size_t transferred;
+    // the file's real size after an O_DIRECT write padded to whole blocks
+    size_t fileSize;
+    vector<uchar> bytes;
+    void* aligned;
+    function<void(int, vector<uchar>&)> onRead;
+    function<void(int)> onWrite;
+    IoRequest ();
+};
+
+IoRequest::IoRequest ()
+    : fd(-1)
+    , writing(false)
+    , data(0)
+    , length(0)
+    , transferred(0)
+    , fileSize(0)
+    , aligned(0) {}
+
+FileIo::FileIo ()
+    : inFlight(0)
+    , writeFailed(false) {}
+
+void FileIo::begin ()
+{
+    unique_lock<mutex> guard(lock);
+    changed.wait(guard, [this] { return inFlight < maxInFlight; });
+    ++inFlight;
+}
+
+void FileIo::read (const string& fileName, const function<void(int, vector<uchar>&)>& done)
+{
+    begin();
+    IoRequest* request = new IoRequest();
+    request->onRead = done;
+    request->fd = ::open(fileName.c_str(), O_RDONLY);
+    struct stat info;
+    if (request->fd < 0 || fstat(request->fd, &info) != 0) {
+        finish(request, errno);
+        return;
+    }
+    request->bytes.resize(info.st_size);
+    request->data = request->bytes.data();
+    request->length = info.st_size;
+    submit(request);
+}
+
+void FileIo::write (const string& fileName, vector<uchar>& bytes, bool direct, const function<void(int)>& done)
+{
+    begin();
+    IoRequest* request = new IoRequest();
+    request->writing = true;
+    request->onWrite = done;
+    request->bytes.swap(bytes);
+    request->data = request->bytes.data();
+    request->length = request->fileSize = request->bytes.size();
+    const int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    if (direct && request->length >= directMinimum) {
+        // O_DIRECT wants block-aligned memory, lengths and offsets: the data
+        // is copied to an aligned buffer padded to whole blocks, and the
+        // file is cut back to its real size afterwards. file systems without
+        // O_DIRECT (tmpfs) get a normal write.
+        const size_t block = directBlock;
+        request->fd = ::open(fileName.c_str(), flags | O_DIRECT, 0644);
+        if (request->fd >= 0 && posix_memalign(&request->aligned, block, request->length + block) == 0) {
+            const size_t padded = (request->length + block - 1) / block * block;
+            memcpy(request->aligned, request->data, request->length);
+            memset(static_cast<uchar*>(request->aligned) + request->length, 0, padded - request->length);
+            request->data = static_cast<uchar*>(request->aligned);
+            request->length = padded;
+            vector<uchar>().swap(request->bytes);
+        } else if (request->fd >= 0) {
+            ::close(request->fd);
+            request->fd = -1;
+        }
+    }
+    if (request->fd < 0) {
+        request->fd = ::open(fileName.c_str(), flags, 0644);
+    }
+    if (request->fd < 0) {
+        finish(request, errno);
+        return;
+    }
+    submit(request);
+}
+
+void FileIo::finish (IoRequest* request, int status)
+{
+    if (request->fd >= 0) {
+        if (status == 0 && request->aligned && ftruncate(request->fd, request->fileSize) != 0) {
+            status = errno;
+        }
+        if (::close(request->fd) != 0 && status == 0 && request->writing) {
+            status = errno;
+        }
+    }
+    if (request->writing) {
+        request->onWrite(status);
+    } else {
+        request->bytes.resize(request->transferred);
+        request->onRead(status, request->bytes);
+    }
+    free(request->aligned);
+    const bool failedWrite = request->writing && status != 0;
+    delete request;
+
+    lock_guard<mutex> guard(lock);
+    writeFailed = writeFailed || failedWrite;
+    --inFlight;
+    changed.notify_all();
+}
+
+// the rest of an O_DIRECT write that came back short would start at an
+// unaligned offset, which O_DIRECT refuses with EINVAL: the tail goes through
+// the page cache instead
+void FileIo::afterShortTransfer (IoRequest* request)
+{
+    if (request->aligned && request->transferred % directBlock != 0) {
+        const int flags = fcntl(request->fd, F_GETFL);
+        if (flags != -1) {
+            fcntl(request->fd, F_SETFL, flags & ~O_DIRECT);
+        }
+    }
+}
+
+bool FileIo::drain ()
+{
+    unique_lock<mutex> guard(lock);
+    changed.wait(guard, [this] { return inFlight == 0; });
+    const bool ok = !writeFailed;
+    writeFailed = false;
+    return ok;
+}
+
+// the fallback backend: a few threads doing blocking pread/pwrite
+class ThreadPoolIo : public FileIo {
+public:
+    explicit ThreadPoolIo (int threads);
+    ~ThreadPoolIo ();
+protected:
+    void submit (IoRequest* request);
+private:
+    BlockingQueue<IoRequest*> requests;
+    vector<thread> workers;
+    void run ();
+};
+
+ThreadPoolIo::ThreadPoolIo (int threads)
+    : requests(maxInFlight)
+{
+    for (int i = 0; i < threads; ++i) {
+        workers.push_back(thread(&ThreadPoolIo::run, this));
+    }
+}
+
+ThreadPoolIo::~ThreadPoolIo ()
+{
+    requests.close();
+    for (size_t i = 0; i < workers.size(); ++i) {
+        workers[i].join();
+    }
+}
+
+void ThreadPoolIo::submit (IoRequest* request)
+{
+    requests.push(request);
+}
+
+void ThreadPoolIo::run ()
+{
+    IoRequest* request;
+    while (requests.pop(request)) {
+        int status = 0;
+        while (request->transferred < request->length) {
+            uchar* p = request->data + request->transferred;
+            const size_t remaining = request->length - request->transferred;
+            const ssize_t n = request->writing ? pwrite(request->fd, p, remaining, request->transferred)
+                                               : pread(request->fd, p, remaining, request->transferred);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                status = errno;
+                break;
+            }
+            if (n == 0) {
+                // a file that shrank since fstat, or a full device
+                status = request->writing ? EIO : 0;
+                break;
+            }
+            request->transferred += n;
+            afterShortTransfer(request);
+        }
+        finish(request, status);
+    }
+}
+
+#ifdef ORIENT_HAVE_IO_URING
+// io_uring through its raw system calls (there is no liburing dependency).
+// submissions are serialized by a lock; one reaper thread waits for
+// completions, resubmits the rest of a short transfer and finishes the
+// rest. the ring has room for every request in flight, so it never fills.
+// a submission the kernel refuses fails its request; if waiting for
+// completions fails for good, every request the kernel holds fails and so
+// does everything submitted after.
+class UringIo : public FileIo {
+public:
+    UringIo ();
+    ~UringIo ();
+    bool isOpened () const;
+protected:
+    void submit (IoRequest* request);
+private:
+    int ringFd;
+    io_uring_params params;
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    io_uring_sqe* sqes;
+    size_t sqesSize;
+    mutex submitLock;
+    // requests in the kernel, and the error that broke the ring (0 while it
+    // works), both under submitLock
+    vector<IoRequest*> pending;
+    int failure;
+    thread reaper;
+    // a nop with this user_data stops the reaper
+    static const uint64_t stopTag = 0;
+    int push (uint8_t opcode, IoRequest* request);
+    void complete (IoRequest* request, int status);
+    void reap ();
+    bool broken ();
+    unsigned* sqField (unsigned offset) const;
+    unsigned* cqField (unsigned offset) const;
+};
+
+UringIo::UringIo ()
+    : ringFd(-1)
+    , sqRing(MAP_FAILED)
+    , sqRingSize(0)
+    , cqRing(MAP_FAILED)
+    , cqRingSize(0)
+    , sqes(0)
+    , sqesSize(0)
+    , failure(0)
+{
+    memset(&params, 0, sizeof(params));
+    ringFd = syscall(__NR_io_uring_setup, 2 * maxInFlight, &params);
+    // IORING_OP_READ and WRITE need linux 5.6; FAST_POLL (5.7) is the
+    // nearest feature bit that implies them
+    if (ringFd < 0 || !(params.features & IORING_FEAT_FAST_POLL)) {
+        return;
+    }
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    sqRing = mmap(0, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    cqRing = mmap(0, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    void* entries = mmap(0, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || entries == MAP_FAILED) {
+        return;
+    }
+    sqes = static_cast<io_uring_sqe*>(entries);
+    reaper = thread(&UringIo::reap, this);
+}
+
+UringIo::~UringIo ()
+{
+    if (reaper.joinable()) {
+        // a reaper that gave up on a broken ring has returned already
+        while (push(IORING_OP_NOP, 0) != 0 && !broken()) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        reaper.join();
+    }
+    if (sqes) {
+        munmap(sqes, sqesSize);
+    }
+    if (sqRing != MAP_FAILED) {
+        munmap(sqRing, sqRingSize);
+    }
+    if (cqRing != MAP_FAILED) {
+        munmap(cqRing, cqRingSize);
+    }
+    if (ringFd >= 0) {
+        close(ringFd);
+    }
+}
+
+bool UringIo::isOpened () const
+{
+    return sqes != 0;
+}
+
+bool UringIo::broken ()
+{
+    lock_guard<mutex> guard(submitLock);
+    return failure != 0;
+}
+
+unsigned* UringIo::sqField (unsigned offset) const
+{
+    return reinterpret_cast<unsigned*>(static_cast<char*>(sqRing) + offset);
+}
+
+unsigned* UringIo::cqField (unsigned offset) const
+{
+    return reinterpret_cast<unsigned*>(static_cast<char*>(cqRing) + offset);
+}
+
+void UringIo::submit (IoRequest* request)
+{
+    if (request->length == 0) {
+        finish(request, 0);
+        return;
+    }
+    const int status = push(request->writing ? IORING_OP_WRITE : IORING_OP_READ, request);
+    if (status != 0) {
+        finish(request, status);
+    }
+}
+
+// queues the next piece of request and enters it into the kernel. returns 0,
+// or the error that kept it out of the kernel; the request is then the
+// caller's to finish.
+int UringIo::push (uint8_t opcode, IoRequest* request)
+{
+    lock_guard<mutex> guard(submitLock);
+    if (failure != 0) {
+        pending.erase(remove(pending.begin(), pending.end(), request), pending.end());
+        return failure;
+    }
+    const unsigned tail = *sqField(params.sq_off.tail);
+    const unsigned index = tail & *sqField(params.sq_off.ring_mask);
+    io_uring_sqe& sqe = sqes[index];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = opcode;
+    sqe.fd = -1;
+    sqe.user_data = reinterpret_cast<uintptr_t>(request);
+    if (request) {
+        sqe.fd = request->fd;
+        sqe.addr = reinterpret_cast<uintptr_t>(request->data + request->transferred);
+        sqe.len = min<size_t>(request->length - request->transferred, 1 << 30);
+        sqe.off = request->transferred;
+    }
+    sqField(params.sq_off.array)[index] = index;
+    __atomic_store_n(sqField(params.sq_off.tail), tail + 1, __ATOMIC_RELEASE);
+    long entered;
+    while ((entered = syscall(__NR_io_uring_enter, ringFd, 1, 0, 0, 0, 0)) < 0 && errno == EINTR) {
+    }
+    if (entered < 1) {
+        // the kernel took nothing (EAGAIN, EBUSY, ENOMEM, ...): the entry
+        // is withdrawn, so the ring holds no stale submission
+        const int error = entered < 0 ? errno : EAGAIN;
+        __atomic_store_n(sqField(params.sq_off.tail), tail, __ATOMIC_RELEASE);
+        pending.erase(remove(pending.begin(), pending.end(), request), pending.end());
+        return error;
+    }
+    if (request && find(pending.begin(), pending.end(), request) == pending.end()) {
+        pending.push_back(request);
+    }
+    return 0;
+}
+
+void UringIo::complete (IoRequest* request, int status)
+{
+    {
+        lock_guard<mutex> guard(submitLock);
+        pending.erase(remove(pending.begin(), pending.end(), request), pending.end());
+    }
+    finish(request, status);
+}
+
+void UringIo::reap ()
+{
+    unsigned* head = cqField(params.cq_off.head);
+    const unsigned* tail = cqField(params.cq_off.tail);
+    const unsigned mask = *cqField(params.cq_off.ring_mask);
+    const io_uring_cqe* cqes = reinterpret_cast<const io_uring_cqe*>(static_cast<char*>(cqRing) + params.cq_off.cqes);
+    while (true) {
+        if (syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, 0, 0) < 0 && errno != EINTR) {
+            if (errno != EAGAIN && errno != EBUSY && errno != ENOMEM) {
+                // nothing more will be reaped: fail what the kernel holds
+                const int error = errno;
+                vector<IoRequest*> lost;
+                {
+                    lock_guard<mutex> guard(submitLock);
+                    failure = error;
+                    lost.swap(pending);
+                }
+                for (size_t i = 0; i < lost.size(); ++i) {
+                    finish(lost[i], error);
+                }
+                return;
+            }
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        unsigned h = *head;
+        while (h != __atomic_load_n(tail, __ATOMIC_ACQUIRE)) {
+            const io_uring_cqe cqe = cqes[h & mask];
+            __atomic_store_n(head, ++h, __ATOMIC_RELEASE);
+            IoRequest* request = reinterpret_cast<IoRequest*>(uintptr_t(cqe.user_data));
+            if (cqe.user_data == stopTag) {
+                return;
+            }
+            if (cqe.res < 0) {
+                complete(request, -cqe.res);
+            } else if (cqe.res == 0) {
+                complete(request, request->writing ? EIO : 0);
+            } else if ((request->transferred += cqe.res) < request->length) {
+                afterShortTransfer(request);
+                const int status = push(request->writing ? IORING_OP_WRITE : IORING_OP_READ, request);
+                if (status != 0) {
+                    finish(request, status);
+                }
+            } else {
+                complete(request, 0);
+            }
+        }
+    }
+}
+#endif
+
+// "uring" falls back to threads where the kernel (or a seccomp filter)
+// refuses io_uring
+FileIo* openFileIo (const string& backend)
+{
+#ifdef ORIENT_HAVE_IO_URING
+    if (backend == "uring") {
+        UringIo* io = new UringIo();
+        if (io->isOpened()) {
+            return io;
+        }
+        delete io;
+        cout << "io_uring is unavailable, using I/O threads" << endl;
+    }
+#else
+    if (backend == "uring") {
+        cout << "built without io_uring, using I/O threads" << endl;
+    }
+#endif
+    return new ThreadPoolIo(4);
+}
+
+
+InputPrefetcher::Entry::Entry ()
+    : ready(false)
+    , status(0) {}
+
+InputPrefetcher::InputPrefetcher (FileIo& io_, size_t capacity_)
+    : io(io_)
+    , capacity(capacity_) {}
+
+void InputPrefetcher::prefetch (const string& fileName)
+{
+    {
+        lock_guard<mutex> guard(lock);
+        if (entries.count(fileName)) {
+            return;
+        }
+        for (size_t i = 0; entries.size() >= capacity && i < order.size(); ) {
+            map<string, Entry>::iterator entry = entries.find(order[i]);
+            if (entry == entries.end() || entry->second.ready) {
+                if (entry != entries.end()) {
+                    entries.erase(entry);
+                }
+                order.erase(order.begin() + i);
+            } else {
+                ++i;
+            }
+        }
+        if (entries.size() >= capacity) {
+            return;
+        }
+        entries[fileName] = Entry();
+        order.push_back(fileName);
+    }
+    io.read(fileName, [this, fileName] (int status, vector<uchar>& bytes) {
+        lock_guard<mutex> guard(lock);
+        Entry& entry = entries[fileName];
+        entry.ready = true;
+        entry.status = status;
+        entry.bytes.swap(bytes);
+        arrived.notify_all();
+    });
+}
+
+bool InputPrefetcher::take (const string& fileName, vector<uchar>& bytes)
+{
+    unique_lock<mutex> guard(lock);
+    if (!entries.count(fileName)) {
+        return false;
+    }
+    arrived.wait(guard, [this, &fileName] { return entries[fileName].ready; });
+    const bool ok = entries[fileName].status == 0;
+    if (ok) {
+        bytes.swap(entries[fileName].bytes);
+    } else {
+        bytes.clear();
+    }
+    entries.erase(fileName);
+    order.erase(find(order.begin(), order.end(), fileName));
+    return ok;
+}
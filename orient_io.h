@@ -0,0 +1,75 @@
+// asynchronous whole-file reads and writes for the batch pipeline (--async-io),
+// see orient_io.cc
+#ifndef ORIENT_IO_H
+#define ORIENT_IO_H
+
+#include "orient_core.h"
+#include <map>
+
+class IoRequest;
+
+// files are opened by the caller; the data then moves on the backend's own
+// threads, and done runs there once a request has completed (status is 0 or
+// an errno). at most maxInFlight requests are outstanding: further calls
+// wait, which bounds the memory held by queued snapshots.
+class FileIo {
+public:
+    FileIo ();
+    virtual ~FileIo () {}
+    // reads all of fileName into the vector passed to done
+    void read (const string& fileName, const function<void(int, vector<uchar>&)>& done);
+    // creates or truncates fileName and writes bytes (taken over, so the
+    // caller's vector is left empty). with direct set, writes of at least
+    // directMinimum bytes bypass the page cache through O_DIRECT.
+    void write (const string& fileName, vector<uchar>& bytes, bool direct, const function<void(int)>& done);
+    // waits for every request submitted so far and its callback; false if
+    // a write since the last drain failed
+    bool drain ();
+    static const int maxInFlight = 32;
+    static const size_t directMinimum = 8 << 20;
+    static const size_t directBlock = 4096;
+protected:
+    // moves the data of an opened request, then calls finish
+    virtual void submit (IoRequest* request) = 0;
+    void finish (IoRequest* request, int status);
+    static void afterShortTransfer (IoRequest* request);
+private:
+    mutex lock;
+    condition_variable changed;
+    int inFlight;
+    bool writeFailed;
+    void begin ();
+};
+
+// "threads" or "uring"
+FileIo* openFileIo (const string& backend);
+
+// reads the inputs of upcoming jobs ahead of time. entries that are never
+// taken (another worker claimed the job) are evicted oldest first once
+// capacity entries are held.
+class InputPrefetcher {
+public:
+    InputPrefetcher (FileIo& io, size_t capacity);
+    // starts reading fileName unless it is already held or on its way
+    void prefetch (const string& fileName);
+    // moves fileName's contents into bytes, waiting for a read in flight;
+    // false, with bytes left empty, if it was never prefetched or the read
+    // failed
+    bool take (const string& fileName, vector<uchar>& bytes);
+private:
+    class Entry {
+    public:
+        bool ready;
+        int status;
+        vector<uchar> bytes;
+        Entry ();
+    };
+    FileIo& io;
+    const size_t capacity;
+    mutex lock;
+    condition_variable arrived;
+    map<string, Entry> entries;
+    deque<string> order;
+};
+
+#endif
@@ -0,0 +1,186 @@
+// the tar and index formats of --pack
+#include "orient_pack.h"
+#include <algorithm>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// an .idx record: where member name's data starts in the pack, and its size
+struct PackIndexEntry {
+    char name[240];
+    uint64_t offset;
+    uint64_t size;
+};
+
+const int tarBlock = 512;
+
+uint64_t tarPadded (uint64_t bytes)
+{
+    return (bytes + tarBlock - 1) / tarBlock * tarBlock;
+}
+
+// leading slashes are dropped, as tar does
+string packMemberName (const string& name)
+{
+    return name.substr(min(name.size(), name.find_first_not_of('/')));
+}
+
+PackWriter::PackWriter ()
+    : packFd(-1)
+    , indexFd(-1)
+    , end(0) {}
+
+PackWriter::~PackWriter ()
+{
+    if (packFd >= 0) {
+        close(packFd);
+    }
+    if (indexFd >= 0) {
+        close(indexFd);
+    }
+}
+
+bool PackWriter::open (const string& baseName)
+{
+    packFd = ::open((baseName + ".tar").c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    indexFd = ::open((baseName + ".idx").c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    struct stat info;
+    if (packFd < 0 || indexFd < 0 || fstat(indexFd, &info) != 0) {
+        return false;
+    }
+    // the pack ends with the last indexed member
+    const off_t entries = info.st_size / sizeof(PackIndexEntry);
+    if (ftruncate(indexFd, entries * sizeof(PackIndexEntry)) != 0) {
+        return false;
+    }
+    if (entries > 0) {
+        PackIndexEntry last;
+        if (pread(indexFd, &last, sizeof(last), (entries - 1) * sizeof(PackIndexEntry)) != sizeof(last)) {
+            return false;
+        }
+        end = last.offset + tarPadded(last.size);
+    }
+    return ftruncate(packFd, end) == 0;
+}
+
+bool PackWriter::add (const string& name, const void* data, size_t bytes)
+{
+    lock_guard<mutex> guard(lock);
+    PackIndexEntry entry;
+    const string member = packMemberName(name);
+    if (packFd < 0 || member.size() >= sizeof(entry.name)) {
+        return false;
+    }
+
+    // ustar keeps up to 100 bytes of the name, and up to 155 bytes of
+    // directories before them in the prefix field
+    char header[tarBlock];
+    memset(header, 0, sizeof(header));
+    size_t split = 0;
+    while (member.size() - split > 100) {
+        split = member.find('/', split + 1);
+        if (split == string::npos || split > 155) {
+            return false;
+        }
+    }
+    if (split > 0) {
+        memcpy(header + 345, member.data(), split);
+        ++split;
+    }
+    memcpy(header + 0, member.data() + split, member.size() - split);
+    snprintf(header + 100, 8, "%07o", 0644);
+    snprintf(header + 108, 8, "%07o", 0);
+    snprintf(header + 116, 8, "%07o", 0);
+    snprintf(header + 124, 12, "%011llo", (unsigned long long)bytes);
+    snprintf(header + 136, 12, "%011llo", (unsigned long long)time(0));
+    header[156] = '0';
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    memset(header + 148, ' ', 8);
+    unsigned int checksum = 0;
+    for (int i = 0; i < tarBlock; ++i) {
+        checksum += (unsigned char)header[i];
+    }
+    snprintf(header + 148, 7, "%06o", checksum);
+
+    const char padding[tarBlock] = {0};
+    if (!writeAll(packFd, header, tarBlock) || !writeAll(packFd, data, bytes)
+        || !writeAll(packFd, padding, tarPadded(bytes) - bytes)) {
+        return false;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    memcpy(entry.name, member.data(), member.size());
+    entry.offset = end + tarBlock;
+    entry.size = bytes;
+    end = entry.offset + tarPadded(bytes);
+    return writeAll(indexFd, &entry, sizeof(entry));
+}
+
+bool PackWriter::addAngles (const string& name, const Mat& angles)
+{
+    ostringstream out;
+    writeAngles(out, angles);
+    const string text = out.str();
+    return add(name, text.data(), text.size());
+}
+
+bool PackWriter::addImage (const string& name, const Mat& image)
+{
+    vector<uchar> bytes;
+    return encodeImage(name, image, bytes) && add(name, bytes.data(), bytes.size());
+}
+
+// maps a whole file read-only; returns 0 if it cannot
+const char* mapFile (const string& fileName, size_t& length)
+{
+    const int fd = ::open(fileName.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return 0;
+    }
+    length = info.st_size;
+    void* base = mmap(0, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    return base == MAP_FAILED ? 0 : static_cast<const char*>(base);
+}
+
+int runUnpack (const string& packName, const string& name)
+{
+    const size_t dot = packName.rfind(".tar");
+    const string indexName = (dot != string::npos && dot + 4 == packName.size() ? packName.substr(0, dot) : packName) + ".idx";
+    size_t packLength = 0, indexLength = 0;
+    const char* pack = mapFile(packName, packLength);
+    const char* index = mapFile(indexName, indexLength);
+    if (!pack || !index) {
+        cerr << "cannot map " << packName << " and " << indexName << endl;
+        return 1;
+    }
+    const string member = packMemberName(name);
+    const PackIndexEntry* entries = reinterpret_cast<const PackIndexEntry*>(index);
+    int status = 1;
+    for (size_t i = indexLength / sizeof(PackIndexEntry); i-- > 0; ) {
+        const PackIndexEntry& entry = entries[i];
+        if (strncmp(entry.name, member.c_str(), sizeof(entry.name)) == 0) {
+            if (entry.offset + entry.size <= packLength) {
+                fwrite(pack + entry.offset, 1, entry.size, stdout);
+                status = 0;
+            }
+            break;
+        }
+    }
+    if (status != 0) {
+        cerr << member << " is not in " << packName << endl;
+    }
+    munmap(const_cast<char*>(pack), packLength);
+    munmap(const_cast<char*>(index), indexLength);
+    return status;
+}
@@ -0,0 +1,40 @@
+// snapshot packs (--pack) and reading members back out of them (--unpack),
+// see orient_pack.cc
+#ifndef ORIENT_PACK_H
+#define ORIENT_PACK_H
+
+#include "orient_core.h"
+#include <cstdint>
+
+// appends snapshots to one tar file per process instead of a file each, so
+// batch runs do not leave millions of small files behind. every member is a
+// ustar header and its data padded to 512 bytes, so tar can list and extract
+// a pack (it has no end-of-archive blocks, as it is never finished). once a
+// member is written, a fixed-size PackIndexEntry pointing at its data is
+// appended to the .idx file next to the pack; the index can be mapped and
+// scanned without reading the pack. a member whose entry never made it to
+// the index (the writer died in between) is cut off when the pack is reopened.
+class PackWriter {
+public:
+    PackWriter ();
+    ~PackWriter ();
+    // opens, or continues, baseName.tar and baseName.idx
+    bool open (const string& baseName);
+    bool add (const string& name, const void* data, size_t bytes);
+    bool addAngles (const string& name, const Mat& angles);
+    bool addImage (const string& name, const Mat& image);
+private:
+    int packFd;
+    int indexFd;
+    uint64_t end;
+    // sweep configurations add members from several threads
+    mutex lock;
+    PackWriter (const PackWriter&);
+    PackWriter& operator= (const PackWriter&);
+};
+
+// writes member name of the pack file_name to stdout, looked up in the
+// mapped index. the last entry of that name wins, as with tar -x.
+int runUnpack (const string& packName, const string& name);
+
+#endif
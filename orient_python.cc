@@ -0,0 +1,293 @@
+// python bindings, built with -DORIENT_PYTHON=ON:
+//
+//     import orient
+//     solver = orient.Solver(image, gradient="scharr", engine="exact")
+//     solver.iterate(10)
+//     angles, magnitudes = solver.angles, solver.magnitudes
+//     solver.iterate(100, budget=0.05)    # as many as fit in 50 ms
+//
+// image is a uint8, uint16 or float32 numpy array of rows x cols (grey) or
+// rows x cols x 3 (RGB, or BGR with rgb=False). it is used where it lies
+// (any row stride, packed pixels) and kept alive by the solver. angles and
+// magnitudes are float32 views of the solver's own buffers: they stay valid
+// as long as any of them is referenced and always show the latest field.
+// iterate releases the GIL, so python threads can run one solver each
+// concurrently, and another thread can cancel() it; it returns how many
+// iterations ran, and the field is always a complete one.
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#include <numpy/arrayobject.h>
+
+#include "orient_solver.h"
+
+struct SolverObject {
+    PyObject_HEAD
+    PyArrayObject* image;
+    FieldSolver* solver;
+    // set while iterate runs without the GIL
+    bool busy;
+};
+
+// the Mat over array's memory, or an empty one after raising ValueError
+Mat wrapImage (PyArrayObject* array)
+{
+    int depth;
+    switch (PyArray_TYPE(array)) {
+    case NPY_UINT8:
+        depth = CV_8U;
+        break;
+    case NPY_UINT16:
+        depth = CV_16U;
+        break;
+    case NPY_FLOAT32:
+        depth = CV_32F;
+        break;
+    default:
+        PyErr_SetString(PyExc_ValueError, "image must be uint8, uint16 or float32");
+        return Mat();
+    }
+    const int dims = PyArray_NDIM(array);
+    const npy_intp* shape = PyArray_DIMS(array);
+    const npy_intp* strides = PyArray_STRIDES(array);
+    const npy_intp item = PyArray_ITEMSIZE(array);
+    const int channels = dims == 3 ? int(shape[2]) : 1;
+    if (dims != 2 && dims != 3) {
+        PyErr_SetString(PyExc_ValueError, "image must be rows x cols or rows x cols x channels");
+        return Mat();
+    }
+    if ((channels != 1 && channels != 3) || shape[0] < 1 || shape[1] < 1) {
+        PyErr_SetString(PyExc_ValueError, "image must be nonempty, grey or color");
+        return Mat();
+    }
+    // rows may be strided (a crop of a larger array), pixels may not
+    if ((dims == 3 && strides[2] != item) || strides[1] != channels * item
+        || strides[0] < shape[1] * strides[1] || strides[0] % item != 0
+        || !PyArray_ISALIGNED(array) || !PyArray_ISNOTSWAPPED(array)) {
+        PyErr_SetString(PyExc_ValueError, "image pixels must be packed, e.g. numpy.ascontiguousarray(image)");
+        return Mat();
+    }
+    return Mat(int(shape[0]), int(shape[1]), CV_MAKETYPE(depth, channels), PyArray_DATA(array), size_t(strides[0]));
+}
+
+int solverInit (SolverObject* self, PyObject* args, PyObject* keywords)
+{
+    static const char* names[] = {"image", "gradient", "engine", "kernel_size", "spatial_sigma", "color_sigma",
+                                  "rgb", 0};
+    PyObject* object;
+    const char* gradientName = "scharr";
+    const char* engine = "exact";
+    int kernelSize = defaultFilterParams.kernelSize;
+    float spatialSigma = defaultFilterParams.spatialSigma;
+    float colorSigma = defaultFilterParams.colorSigma;
+    int rgbOrder = 1;
+    if (!PyArg_ParseTupleAndKeywords(args, keywords, "O|ssiffp", const_cast<char**>(names), &object, &gradientName,
+                                     &engine, &kernelSize, &spatialSigma, &colorSigma, &rgbOrder)) {
+        return -1;
+    }
+    GradientOperator op;
+    if (!parseGradientOperator(gradientName, op)) {
+        PyErr_Format(PyExc_ValueError, "unknown gradient %s", gradientName);
+        return -1;
+    }
+    if (string(engine) != "exact" && string(engine) != "grid") {
+        PyErr_Format(PyExc_ValueError, "unknown engine %s", engine);
+        return -1;
+    }
+    if (kernelSize < 1 || kernelSize % 2 == 0 || spatialSigma <= 0 || colorSigma <= 0) {
+        PyErr_SetString(PyExc_ValueError, "kernel_size must be odd and the sigmas positive");
+        return -1;
+    }
+    if (!PyArray_Check(object)) {
+        PyErr_SetString(PyExc_TypeError, "image must be a numpy array");
+        return -1;
+    }
+    PyArrayObject* array = reinterpret_cast<PyArrayObject*>(object);
+    const Mat image = wrapImage(array);
+    if (image.empty()) {
+        return -1;
+    }
+    if (self->solver) {
+        PyErr_SetString(PyExc_RuntimeError, "solver is already initialized");
+        return -1;
+    }
+
+    FieldSolver* solver = 0;
+    string error;
+    Py_BEGIN_ALLOW_THREADS
+    try {
+        solver = new FieldSolver(image, rgbOrder != 0, FilterParams(kernelSize, spatialSigma, colorSigma), op,
+                                 string(engine) == "grid");
+    } catch (const exception& e) {
+        error = e.what();
+    }
+    Py_END_ALLOW_THREADS
+    if (!solver) {
+        PyErr_SetString(PyExc_RuntimeError, error.c_str());
+        return -1;
+    }
+    Py_INCREF(array);
+    self->image = array;
+    self->solver = solver;
+    return 0;
+}
+
+void solverDealloc (SolverObject* self)
+{
+    delete self->solver;
+    Py_XDECREF(self->image);
+    Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+}
+
+bool checkReady (SolverObject* self)
+{
+    if (!self->solver) {
+        PyErr_SetString(PyExc_RuntimeError, "solver is not initialized");
+        return false;
+    }
+    if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "solver is iterating in another thread");
+        return false;
+    }
+    return true;
+}
+
+PyObject* solverIterate (SolverObject* self, PyObject* args, PyObject* keywords)
+{
+    static const char* names[] = {"times", "threads", "budget", 0};
+    int times = 1;
+    int threads = 0;
+    double budget = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, keywords, "|iid", const_cast<char**>(names), &times, &threads,
+                                     &budget)) {
+        return 0;
+    }
+    if (!checkReady(self)) {
+        return 0;
+    }
+    self->busy = true;
+    string error;
+    int completed = 0;
+    Py_BEGIN_ALLOW_THREADS
+    try {
+        // the team size is per calling thread, so each python thread can
+        // take its share of the cores; the thread's own setting comes back
+        // afterwards
+        TeamSize team(threads);
+        completed = self->solver->iterate(times, budget);
+    } catch (const exception& e) {
+        error = e.what();
+    }
+    Py_END_ALLOW_THREADS
+    self->busy = false;
+    if (!error.empty()) {
+        PyErr_SetString(PyExc_RuntimeError, error.c_str());
+        return 0;
+    }
+    return PyLong_FromLong(completed);
+}
+
+PyObject* solverCancel (SolverObject* self, PyObject*)
+{
+    if (self->solver) {
+        self->solver->cancelToken.cancel();
+    }
+    Py_RETURN_NONE;
+}
+
+// a float32 array over field that keeps self (and so field) alive
+PyObject* fieldView (SolverObject* self, const Mat& field)
+{
+    npy_intp shape[2] = {field.rows, field.cols};
+    npy_intp strides[2] = {npy_intp(field.step[0]), npy_intp(sizeof(float))};
+    PyObject* view = PyArray_New(&PyArray_Type, 2, shape, NPY_FLOAT32, strides, field.data, 0,
+                                 NPY_ARRAY_CARRAY, 0);
+    if (!view) {
+        return 0;
+    }
+    Py_INCREF(self);
+    if (PyArray_SetBaseObject(reinterpret_cast<PyArrayObject*>(view), reinterpret_cast<PyObject*>(self)) != 0) {
+        Py_DECREF(view);
+        return 0;
+    }
+    return view;
+}
+
+PyObject* solverAngles (SolverObject* self, void*)
+{
+    if (!self->solver) {
+        PyErr_SetString(PyExc_RuntimeError, "solver is not initialized");
+        return 0;
+    }
+    return fieldView(self, self->solver->angles);
+}
+
+PyObject* solverMagnitudes (SolverObject* self, void*)
+{
+    if (!self->solver) {
+        PyErr_SetString(PyExc_RuntimeError, "solver is not initialized");
+        return 0;
+    }
+    return fieldView(self, self->solver->magnitudes);
+}
+
+PyMethodDef solverMethods[] = {
+    {"iterate", reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)()>(solverIterate)),
+     METH_VARARGS | METH_KEYWORDS,
+     "iterate(times=1, threads=0, budget=0.0): runs up to times iterations without the GIL on threads "
+     "OpenMP threads (0: the default), stopping early after budget seconds (0: no limit) or on cancel(); "
+     "returns how many ran"},
+    {"cancel", reinterpret_cast<PyCFunction>(solverCancel), METH_NOARGS,
+     "cancel(): stops an iterate running in another thread within a tile of work, or the next iterate "
+     "if none is running"},
+    {0, 0, 0, 0}
+};
+
+PyGetSetDef solverFields[] = {
+    {const_cast<char*>("angles"), reinterpret_cast<getter>(solverAngles), 0,
+     const_cast<char*>("orientations in radians, [-pi/2, pi/2), a view of the solver's buffer"), 0},
+    {const_cast<char*>("magnitudes"), reinterpret_cast<getter>(solverMagnitudes), 0,
+     const_cast<char*>("gradient magnitudes, a view of the solver's buffer"), 0},
+    {0, 0, 0, 0, 0}
+};
+
+// CPython's header initializers leave every other slot zero, filled in by
+// PyInit_orient
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+PyTypeObject solverType = {PyVarObject_HEAD_INIT(0, 0)};
+
+PyModuleDef moduleDef = {PyModuleDef_HEAD_INIT};
+#pragma GCC diagnostic pop
+
+PyMODINIT_FUNC PyInit_orient ()
+{
+    import_array();
+    solverType.tp_name = "orient.Solver";
+    solverType.tp_basicsize = sizeof(SolverObject);
+    solverType.tp_flags = Py_TPFLAGS_DEFAULT;
+    solverType.tp_doc = "Solver(image, gradient='scharr', engine='exact', kernel_size=5, spatial_sigma=2.0, "
+                        "color_sigma=10.0, rgb=True): the orientation field of a numpy image";
+    solverType.tp_new = PyType_GenericNew;
+    solverType.tp_init = reinterpret_cast<initproc>(solverInit);
+    solverType.tp_dealloc = reinterpret_cast<destructor>(solverDealloc);
+    solverType.tp_methods = solverMethods;
+    solverType.tp_getset = solverFields;
+    if (PyType_Ready(&solverType) < 0) {
+        return 0;
+    }
+    moduleDef.m_name = "orient";
+    moduleDef.m_doc = "orientation fields of images by iterated bilateral filtering";
+    moduleDef.m_size = -1;
+    PyObject* module = PyModule_Create(&moduleDef);
+    if (!module) {
+        return 0;
+    }
+    Py_INCREF(&solverType);
+    if (PyModule_AddObject(module, "Solver", reinterpret_cast<PyObject*>(&solverType)) < 0) {
+        Py_DECREF(&solverType);
+        Py_DECREF(module);
+        return 0;
+    }
+    return module;
+}
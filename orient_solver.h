@@ -0,0 +1,114 @@
+// the solver as the bindings embed it (orient_python.cc, orient_c.cc); their
+// targets compile orient.cc without its main
+#ifndef ORIENT_SOLVER_H
+#define ORIENT_SOLVER_H
+
+#include "orient_core.h"
+#include <atomic>
+#include <cstdint>
+
+// the calling thread's OpenMP team size for one call into the library
+// interfaces, restored afterwards: it is per thread state the host owns
+class TeamSize {
+public:
+    explicit TeamSize (int threads);
+    ~TeamSize ();
+private:
+    int saved;
+};
+
+// how iterate splits the image among threads: tiles of rows x cols pixels
+// (cols 0 for whole rows), handed out dynamically. every cell is computed
+// the same way whatever the tiling, so it only changes the speed.
+class Tiling {
+public:
+    int rows;
+    int cols;
+    Tiling (int rows_, int cols_);
+};
+
+// rows of one pixel, whole width
+extern const Tiling defaultTiling;
+
+// stops a run early: cancel (from another thread, or a signal handler since
+// it only stores a lock-free atomic) or a wall-clock deadline. iterate looks
+// at it before every tile and abandons an iteration it interrupts, so a
+// stop takes effect within one tile of work per thread and the field stays
+// the last complete one.
+class CancelToken {
+public:
+    CancelToken ();
+    void cancel ();
+    // clears a cancel and the deadline, for the next run
+    void reset ();
+    // the deadline becomes seconds from now
+    void setBudget (double seconds);
+    bool cancelled () const;
+    bool stopped () const;
+    // whether seconds more of work would end before the deadline
+    bool fits (double seconds) const;
+private:
+    atomic<bool> cancelFlag;
+    // steady clock nanoseconds, 0 for none
+    atomic<int64_t> deadline;
+    static int64_t now ();
+};
+
+// one run under a token that other threads cancel: the budget (seconds, 0
+// for none) starts now, and the token is reset when the run ends rather
+// than when it starts, so a cancel that comes in just before the run is
+// not lost: it stops the run at once
+class CancelRun {
+public:
+    CancelRun (CancelToken& token_, double budgetSeconds);
+    ~CancelRun ();
+private:
+    CancelToken& token;
+};
+
+// the initial field: the gradients of the decoded image, see orient.cc
+void calcGradients (const Mat& coloredImage, Mat& angles, Mat& magnitudes,
+                    GradientOperator op=GRADIENT_SCHARR, bool fixedPoint=false, bool rgbOrder=false);
+
+// one iteration of the field through the next buffers, which it swaps in;
+// see orient.cc
+bool iterate (const FilterParams& params, const BilateralWeights& weights, Mat& angles, Mat& magnitudes,
+              Mat& nextAngles, Mat& nextMagnitudes, const Mat& coloredImage,
+              const Tiling& tiling=defaultTiling, const CancelToken* cancel=0);
+bool iterate (const FilterParams& params, Mat& angles, Mat& magnitudes,
+              Mat& nextAngles, Mat& nextMagnitudes, const Mat& coloredImage,
+              const Tiling& tiling=defaultTiling, const CancelToken* cancel=0);
+
+// returns false if name is not one of "scharr", "sobel3", "sobel5", "sobel7",
+// "central" and "tensor"
+bool parseGradientOperator (const string& name, GradientOperator& op);
+
+class BilateralGrid;
+
+// the solver for embedding (see orient_python.cc): it reads the caller's
+// image where it lies and keeps the field in two fixed buffers, so views of
+// angles and magnitudes stay valid and always show the latest field
+class FieldSolver {
+public:
+    FieldSolver (const Mat& image_, bool rgbOrder, const FilterParams& params_, GradientOperator op, bool useGrid);
+    ~FieldSolver ();
+    // runs up to times iterations, fewer if the budget (seconds, 0 for
+    // none) runs out or cancelToken is cancelled, also by a cancel since the
+    // last iterate returned; returns how many ran
+    int iterate (int times, double budgetSeconds=0);
+    Mat angles;
+    Mat magnitudes;
+    // cancel stops an iterate in progress, from any thread
+    CancelToken cancelToken;
+private:
+    const Mat image;
+    const FilterParams params;
+    const BilateralWeights weights;
+    Mat nextAngles;
+    Mat nextMagnitudes;
+    BilateralGrid* grid;
+    FieldSolver (const FieldSolver&);
+    FieldSolver& operator= (const FieldSolver&);
+};
+
+#endif
@@ -0,0 +1,346 @@
+// the spool: jobs, leases, heartbeats and the worker and coordinator loops
+#include "orient_spool.h"
+#include "orient_io.h"
+#include <algorithm>
+#include <fstream>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+// a spool directory shared by any number of workers, on any machines that
+// mount it. jobs move between subdirectories by rename(), which is atomic
+// within one file system, so no central service hands them out:
+//   pending/<job>.job           waiting; the file holds the image path, then
+//                               the iteration count and the save step
+//   running/<job>.job.<worker>  claimed; the worker touches it as a heartbeat
+//   done/<job>.job, failed/<job>.job, and <job>.stats next to either
+// a lease whose heartbeat is older than --lease-seconds is renamed back to
+// pending/ by whichever process notices first. a worker that then finishes
+// anyway finds its lease gone and drops its stats; its map files are
+// rewritten with the same content by the next claimant.
+const char* const spoolStates[] = {"pending", "running", "done", "failed"};
+
+string spoolPath (const string& spool, const string& state, const string& name="")
+{
+    return spool + "/" + state + (name.empty() ? "" : "/" + name);
+}
+
+vector<string> listSpool (const string& spool, const string& state)
+{
+    vector<string> names;
+    DIR* dir = opendir(spoolPath(spool, state).c_str());
+    if (!dir) {
+        return names;
+    }
+    while (dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+    sort(names.begin(), names.end());
+    return names;
+}
+
+// pending and running leases, or finished jobs without their stats
+size_t countJobs (const string& spool, const string& state)
+{
+    const vector<string> names = listSpool(spool, state);
+    size_t jobs = 0;
+    for (size_t i = 0; i < names.size(); ++i) {
+        jobs += names[i].find(".job") != string::npos;
+    }
+    return jobs;
+}
+
+// <host>-<pid>, unique among the workers sharing a spool
+string spoolWorkerId ()
+{
+    char host[256] = "localhost";
+    gethostname(host, sizeof(host) - 1);
+    return string(host) + "-" + to_string(getpid());
+}
+
+// moves leases that have missed their heartbeats back to pending/
+void reclaimStaleLeases (const string& spool, int leaseSeconds)
+{
+    const vector<string> leases = listSpool(spool, "running");
+    const time_t now = time(0);
+    for (size_t i = 0; i < leases.size(); ++i) {
+        const string lease = spoolPath(spool, "running", leases[i]);
+        struct stat info;
+        if (stat(lease.c_str(), &info) != 0 || now - info.st_mtime <= leaseSeconds) {
+            continue;
+        }
+        const size_t suffix = leases[i].find(".job.");
+        if (suffix == string::npos) {
+            // not a lease this program took
+            continue;
+        }
+        const string job = leases[i].substr(0, suffix + 4);
+        if (rename(lease.c_str(), spoolPath(spool, "pending", job).c_str()) == 0) {
+            cout << "reclaimed " << job << " from " << leases[i].substr(job.size() + 1) << endl;
+        }
+    }
+}
+
+// touches a lease every few seconds until stopped; lost() tells whether the
+// lease was reclaimed from under the worker
+class Heartbeat {
+public:
+    Heartbeat (const string& lease, int leaseSeconds);
+    ~Heartbeat ();
+    bool lost () const;
+private:
+    string lease;
+    int periodSeconds;
+    bool stopped;
+    bool leaseLost;
+    mutable mutex lock;
+    condition_variable wake;
+    thread beater;
+    void run ();
+};
+
+Heartbeat::Heartbeat (const string& lease_, int leaseSeconds)
+    : lease(lease_)
+    , periodSeconds(max(1, leaseSeconds / 4))
+    , stopped(false)
+    , leaseLost(false)
+    , beater(&Heartbeat::run, this) {}
+
+Heartbeat::~Heartbeat ()
+{
+    {
+        unique_lock<mutex> guard(lock);
+        stopped = true;
+    }
+    wake.notify_one();
+    beater.join();
+}
+
+bool Heartbeat::lost () const
+{
+    unique_lock<mutex> guard(lock);
+    return leaseLost;
+}
+
+void Heartbeat::run ()
+{
+    unique_lock<mutex> guard(lock);
+    while (!wake.wait_for(guard, chrono::seconds(periodSeconds), [this] { return stopped; })) {
+        if (utimes(lease.c_str(), 0) != 0) {
+            leaseLost = true;
+        }
+    }
+}
+
+// file_name lists one image per line; each becomes a pending job with this
+// run's iteration count and save step
+int enqueueSpool (const Options& options)
+{
+    ifstream list(options.imageName.c_str());
+    if (!list) {
+        cout << "cannot read " << options.imageName << endl;
+        return 1;
+    }
+    for (int i = 0; i < 4; ++i) {
+        mkdir(spoolPath(options.spool, spoolStates[i]).c_str(), 0777);
+    }
+    // numbering continues after jobs left by earlier runs
+    int next = 0;
+    for (int i = 0; i < 4; ++i) {
+        const vector<string> names = listSpool(options.spool, spoolStates[i]);
+        for (size_t j = 0; j < names.size(); ++j) {
+            next = max(next, atoi(names[j].c_str()) + 1);
+        }
+    }
+    int enqueued = 0;
+    string imageName;
+    while (getline(list, imageName)) {
+        if (imageName.empty()) {
+            continue;
+        }
+        char job[32];
+        snprintf(job, sizeof(job), "%08d.job", next++);
+        // written under a dot name, which workers skip, then published
+        const string hidden = spoolPath(options.spool, "pending", string(".") + job);
+        ofstream out(hidden.c_str());
+        out << imageName << endl << options.iterationTimes << " " << options.saveStep << endl;
+        out.close();
+        if (!out || rename(hidden.c_str(), spoolPath(options.spool, "pending", job).c_str()) != 0) {
+            cout << "cannot enqueue " << imageName << endl;
+            return 1;
+        }
+        ++enqueued;
+    }
+    cout << "enqueued " << enqueued << " jobs in " << options.spool << endl;
+    return 0;
+}
+
+// starts reading the inputs of the first few pending jobs, which this
+// worker is likely to claim next. mapped inputs (raw, PNM) gain nothing.
+void prefetchPending (const Options& options, InputPrefetcher& prefetcher)
+{
+    const size_t depth = 2;
+    const vector<string> pending = listSpool(options.spool, "pending");
+    for (size_t i = 0; i < pending.size() && i < depth; ++i) {
+        ifstream in(spoolPath(options.spool, "pending", pending[i]).c_str());
+        string imageName;
+        if (getline(in, imageName) && options.rawSpec.empty() && !isPnmFile(imageName)) {
+            prefetcher.prefetch(imageName);
+        }
+    }
+}
+
+// claims pending jobs until the spool has neither pending nor running ones;
+// when nothing is pending it reclaims stale leases for the other workers.
+// with --async-io the next jobs' inputs are read while this one runs, and a
+// job only counts as done once its snapshots are on disk.
+int runSpoolWorker (const Options& options)
+{
+    const string worker = spoolWorkerId();
+    int processed = 0;
+    InputPrefetcher* prefetcher = options.io && !options.strips ? new InputPrefetcher(*options.io, 8) : 0;
+    while (true) {
+        const vector<string> pending = listSpool(options.spool, "pending");
+        string job, lease;
+        for (size_t i = 0; i < pending.size() && job.empty(); ++i) {
+            const string claimed = spoolPath(options.spool, "running", pending[i] + "." + worker);
+            if (rename(spoolPath(options.spool, "pending", pending[i]).c_str(), claimed.c_str()) == 0) {
+                // a reclaimed job keeps its stale time until touched
+                utimes(claimed.c_str(), 0);
+                job = pending[i];
+                lease = claimed;
+            }
+        }
+        if (job.empty()) {
+            reclaimStaleLeases(options.spool, options.leaseSeconds);
+            if (countJobs(options.spool, "pending") == 0 && countJobs(options.spool, "running") == 0) {
+                break;
+            }
+            sleep(1);
+            continue;
+        }
+
+        Options jobOptions = options;
+        ifstream in(lease.c_str());
+        getline(in, jobOptions.imageName);
+        in >> jobOptions.iterationTimes >> jobOptions.saveStep;
+        string problem;
+        if (jobOptions.imageName.empty()) {
+            problem = "no image name";
+        } else if (!in) {
+            problem = "no readable iteration count and save step";
+        } else if (jobOptions.iterationTimes < 0) {
+            problem = "a negative iteration count";
+        } else if (jobOptions.saveStep < 1) {
+            problem = "a save step below 1";
+        }
+        in.close();
+        if (problem.empty()) {
+            cout << worker << " running " << job << ": " << jobOptions.imageName << endl;
+        } else {
+            cout << worker << " failing " << job << ": the job file has " << problem << endl;
+        }
+        if (prefetcher) {
+            if (!prefetcher->take(jobOptions.imageName, jobOptions.prefetched)) {
+                // never prefetched or the read failed: runImage reads it itself
+                jobOptions.prefetched.clear();
+            }
+            prefetchPending(options, *prefetcher);
+        }
+
+        int status = 1;
+        const int64 start = getTickCount();
+        bool lost = false;
+        if (problem.empty()) {
+            Heartbeat heartbeat(lease, options.leaseSeconds);
+            status = jobOptions.strips ? runStrips(jobOptions) : runImage(jobOptions);
+            if (options.io && !options.io->drain()) {
+                status = 1;
+            }
+            lost = heartbeat.lost();
+        }
+        const double seconds = (getTickCount() - start) / getTickFrequency();
+
+        const string state = status == 0 ? "done" : "failed";
+        const string stats = spoolPath(options.spool, state, job.substr(0, job.size() - 4) + ".stats");
+        ofstream out((stats + "." + worker).c_str());
+        out << "image " << jobOptions.imageName << endl
+            << "worker " << worker << endl
+            << "status " << status << endl
+            << "iterations " << jobOptions.iterationTimes << endl
+            << "seconds " << seconds << endl;
+        out.close();
+        if (lost || rename(lease.c_str(), spoolPath(options.spool, state, job).c_str()) != 0) {
+            cout << worker << " lost the lease on " << job << ", dropping its stats" << endl;
+            unlink((stats + "." + worker).c_str());
+            continue;
+        }
+        rename((stats + "." + worker).c_str(), stats.c_str());
+        ++processed;
+    }
+    if (prefetcher) {
+        // reads of jobs claimed elsewhere still refer to the prefetcher
+        options.io->drain();
+        delete prefetcher;
+    }
+    cout << worker << " processed " << processed << " jobs" << endl;
+    return 0;
+}
+
+// enqueues file_name's images, then waits for the workers, reclaiming stale
+// leases like any of them, and sums up the stats
+int runSpoolCoordinator (const Options& options)
+{
+    if (enqueueSpool(options) != 0) {
+        return 1;
+    }
+    size_t lastDone = size_t(-1);
+    while (true) {
+        reclaimStaleLeases(options.spool, options.leaseSeconds);
+        const size_t pending = countJobs(options.spool, "pending");
+        const size_t running = countJobs(options.spool, "running");
+        const size_t done = countJobs(options.spool, "done") + countJobs(options.spool, "failed");
+        if (done != lastDone) {
+            cout << pending << " pending, " << running << " running, " << done << " finished" << endl;
+            lastDone = done;
+        }
+        if (pending == 0 && running == 0) {
+            break;
+        }
+        sleep(1);
+    }
+
+    int failed = 0;
+    double seconds = 0;
+    const vector<string> finished = listSpool(options.spool, "done");
+    for (size_t i = 0; i < finished.size(); ++i) {
+        if (finished[i].size() < 6 || finished[i].substr(finished[i].size() - 6) != ".stats") {
+            continue;
+        }
+        ifstream in(spoolPath(options.spool, "done", finished[i]).c_str());
+        string line;
+        while (getline(in, line)) {
+            if (line.compare(0, 8, "seconds ") == 0) {
+                seconds += atof(line.c_str() + 8);
+            }
+        }
+    }
+    const vector<string> failures = listSpool(options.spool, "failed");
+    for (size_t i = 0; i < failures.size(); ++i) {
+        if (failures[i].find(".job") != string::npos) {
+            cout << "failed: " << failures[i] << endl;
+            ++failed;
+        }
+    }
+    cout << "jobs took " << seconds << " s of worker time, " << failed << " failed" << endl;
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,14 @@
+// batch runs over a spool directory (--spool), see orient_spool.cc
+#ifndef ORIENT_SPOOL_H
+#define ORIENT_SPOOL_H
+
+#include "orient_core.h"
+
+// <host>-<pid>, unique among the workers sharing a spool
+string spoolWorkerId ();
+// claims and runs jobs until the spool is empty
+int runSpoolWorker (const Options& options);
+// enqueues file_name's images, waits for the workers and sums up the stats
+int runSpoolCoordinator (const Options& options);
+
+#endif
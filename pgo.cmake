@@ -0,0 +1,70 @@
+# profile-guided build of orient, run by the pgo target:
+#   1. BINARY_DIR/pgo gets an instrumented Release build, which runs the
+#      --synthetic benchmark to record a profile
+#   2. the same directory is rebuilt with the profile (gcc finds its .gcda
+#      files by object path, so it has to be the same directory), and
+#      BINARY_DIR/release gets a plain Release build to compare against
+#   3. both run the benchmark and the times are reported
+# the optimized binary is BINARY_DIR/pgo/orient.
+set( BENCHMARK 6 6 --synthetic 1024,1024 )
+set( PROFILE_DIR ${BINARY_DIR}/profile )
+
+function( build dir pgo )
+    file( MAKE_DIRECTORY ${dir} )
+    execute_process( COMMAND ${CMAKE_COMMAND} ${SOURCE_DIR} -DCMAKE_BUILD_TYPE=Release
+                             -DCMAKE_CXX_COMPILER=${CXX} -DORIENT_PGO=${pgo} -DORIENT_PGO_DIR=${PROFILE_DIR}
+                     WORKING_DIRECTORY ${dir} RESULT_VARIABLE status )
+    if( NOT status EQUAL 0 )
+        message( FATAL_ERROR "configuring ${dir} failed" )
+    endif()
+    execute_process( COMMAND ${CMAKE_COMMAND} --build . WORKING_DIRECTORY ${dir} RESULT_VARIABLE status )
+    if( NOT status EQUAL 0 )
+        message( FATAL_ERROR "building ${dir} failed" )
+    endif()
+endfunction()
+
+# best of three benchmark runs, in whole ms
+function( bench dir result )
+    set( best "" )
+    foreach( run 1 2 3 )
+        execute_process( COMMAND ${dir}/orient ${dir}/bench ${BENCHMARK}
+                         WORKING_DIRECTORY ${dir} OUTPUT_VARIABLE output RESULT_VARIABLE status )
+        if( NOT status EQUAL 0 OR NOT output MATCHES "benchmark: ([0-9]+)" )
+            message( FATAL_ERROR "the benchmark failed in ${dir}" )
+        endif()
+        if( best STREQUAL "" OR CMAKE_MATCH_1 LESS best )
+            set( best ${CMAKE_MATCH_1} )
+        endif()
+    endforeach()
+    set( ${result} ${best} PARENT_SCOPE )
+endfunction()
+
+file( REMOVE_RECURSE ${PROFILE_DIR} )
+file( MAKE_DIRECTORY ${PROFILE_DIR} )
+build( ${BINARY_DIR}/pgo generate )
+set( ENV{LLVM_PROFILE_FILE} ${PROFILE_DIR}/orient-%p.profraw )
+execute_process( COMMAND ${BINARY_DIR}/pgo/orient ${BINARY_DIR}/pgo/bench ${BENCHMARK}
+                 WORKING_DIRECTORY ${BINARY_DIR}/pgo RESULT_VARIABLE status )
+if( NOT status EQUAL 0 )
+    message( FATAL_ERROR "the training run failed" )
+endif()
+if( COMPILER_ID MATCHES "Clang" )
+    get_filename_component( compilerDir ${CXX} DIRECTORY )
+    find_program( PROFDATA NAMES llvm-profdata HINTS ${compilerDir} )
+    if( NOT PROFDATA )
+        message( FATAL_ERROR "clang profiles need llvm-profdata" )
+    endif()
+    file( GLOB raw ${PROFILE_DIR}/*.profraw )
+    execute_process( COMMAND ${PROFDATA} merge -output=${PROFILE_DIR}/orient.profdata ${raw}
+                     RESULT_VARIABLE status )
+    if( NOT status EQUAL 0 )
+        message( FATAL_ERROR "merging the profile failed" )
+    endif()
+endif()
+
+build( ${BINARY_DIR}/pgo use )
+build( ${BINARY_DIR}/release "" )
+bench( ${BINARY_DIR}/release releaseMs )
+bench( ${BINARY_DIR}/pgo pgoMs )
+math( EXPR gain "100 * (${releaseMs} - ${pgoMs}) / ${releaseMs}" )
+message( STATUS "synthetic benchmark: release ${releaseMs} ms, release+pgo ${pgoMs} ms, ${gain}% faster" )